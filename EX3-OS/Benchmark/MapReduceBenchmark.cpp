@@ -0,0 +1,1207 @@
+#include "MapReduceFramework.h"
+#include "MapReduceJob.h"
+#include "MappedLineSource.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <deque>
+#include <atomic>
+#include <algorithm>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define KEY_COUNT 256
+
+static const int THREAD_LEVELS[] = {1, 2, 4, 8, 16, 32, 64};
+static const int JOB_LEVELS[] = {1, 2, 4, 8, 16, 32};
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Measures a phase from inside the client, from the start of its first call to the end of its last.
+ */
+struct PhaseClock {
+    PhaseClock() : start(1e300), end(0) {}
+
+    void begin() {
+        double now = nowSeconds();
+        double current = start.load();
+        while (now < current && !start.compare_exchange_weak(current, now)) {}
+    }
+
+    void finish() {
+        double now = nowSeconds();
+        double current = end.load();
+        while (now > current && !end.compare_exchange_weak(current, now)) {}
+    }
+
+    double seconds() const {
+        return end.load() > 0 ? end.load() - start.load() : 0;
+    }
+
+    std::atomic<double> start;
+    std::atomic<double> end;
+};
+
+/**
+ * Busy work standing in for client computation.
+ */
+static void burn(int units) {
+    volatile unsigned long sink = 0;
+    for (int i = 0; i < units * 100; ++i) {
+        sink = sink + i;
+    }
+}
+
+class VIndex : public V1 {
+public:
+    explicit VIndex(int index) : index(index) {}
+    int index;
+};
+
+class KWord : public K2, public K3 {
+public:
+    explicit KWord(int word) : word(word) {}
+    virtual bool operator<(const K2 &other) const {
+        return word < static_cast<const KWord &>(other).word;
+    }
+    virtual bool operator<(const K3 &other) const {
+        return word < static_cast<const KWord &>(other).word;
+    }
+    int word;
+};
+
+class VCount : public V2, public V3 {
+public:
+    explicit VCount(long count) : count(count) {}
+    long count;
+};
+
+/**
+ * Emits pairsPerInput preallocated (word, 1) pairs per input, so the timing measures
+ * the framework and not the allocator. With a lock, every emit2 goes through one shared
+ * mutex the way the old emit2 did. The map phase is timed from the first map call to the
+ * end of the last one.
+ */
+class EmitClient : public MapReduceClient {
+public:
+    EmitClient(int pairsPerInput, pthread_mutex_t *lock)
+            : pairsPerInput(pairsPerInput), lock(lock), one(new VCount(1)), acquisitions(0), contended(0) {
+        for (int i = 0; i < KEY_COUNT; ++i) {
+            keys.push_back(new KWord(i));
+        }
+    }
+
+    ~EmitClient() {
+        for (KWord *key : keys) {
+            delete key;
+        }
+        delete one;
+    }
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        mapClock.begin();
+        int index = static_cast<const VIndex *>(value)->index;
+        for (int i = 0; i < pairsPerInput; ++i) {
+            KWord *word = keys[(index * 31 + i * 7) % KEY_COUNT];
+            if (lock == nullptr) {
+                emit2(word, one, context);
+                continue;
+            }
+            if (pthread_mutex_trylock(lock) != 0) {
+                contended.fetch_add(1, std::memory_order_relaxed);
+                pthread_mutex_lock(lock);
+            }
+            acquisitions.fetch_add(1, std::memory_order_relaxed);
+            emit2(word, one, context);
+            pthread_mutex_unlock(lock);
+        }
+        mapClock.finish();
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        (void) pairs;
+        (void) context;
+    }
+
+    int pairsPerInput;
+    pthread_mutex_t *lock;
+    std::vector<KWord *> keys;
+    VCount *one;
+    mutable std::atomic<long> acquisitions;
+    mutable std::atomic<long> contended;
+    mutable PhaseClock mapClock;
+};
+
+/**
+ * A skewed job: the first tenth of the input costs SKEW_FACTOR times more to map, and keys follow a
+ * Zipf distribution, so reduce groups (whose cost grows with their size) are skewed too.
+ */
+#define SKEW_FACTOR 20
+#define ZIPF_TABLE_SIZE 4096
+
+class SkewClient : public MapReduceClient {
+public:
+    SkewClient(int inputs, int pairsPerInput) : inputs(inputs), pairsPerInput(pairsPerInput), one(new VCount(1)) {
+        std::vector<double> cdf;
+        double total = 0;
+        for (int rank = 1; rank <= KEY_COUNT; ++rank) {
+            total += 1.0 / rank;
+            cdf.push_back(total);
+        }
+        for (int i = 0; i < KEY_COUNT; ++i) {
+            keys.push_back(new KWord(i));
+        }
+        for (int i = 0; i < ZIPF_TABLE_SIZE; ++i) {
+            double u = (i + 0.5) / ZIPF_TABLE_SIZE * total;
+            zipfKeys.push_back(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        }
+    }
+
+    ~SkewClient() {
+        for (KWord *key : keys) {
+            delete key;
+        }
+        delete one;
+    }
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        mapClock.begin();
+        int index = static_cast<const VIndex *>(value)->index;
+        burn(index < inputs / 10 ? SKEW_FACTOR : 1);
+        for (int i = 0; i < pairsPerInput; ++i) {
+            emit2(keys[zipfKeys[(index * 131 + i * 17) % ZIPF_TABLE_SIZE]], one, context);
+        }
+        mapClock.finish();
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        (void) context;
+        reduceClock.begin();
+        burn(static_cast<int>(pairs->size()) / 8 + 1);
+        reduceClock.finish();
+    }
+
+    int inputs;
+    int pairsPerInput;
+    std::vector<KWord *> keys;
+    std::vector<int> zipfKeys;
+    VCount *one;
+    mutable PhaseClock mapClock;
+    mutable PhaseClock reduceClock;
+};
+
+/**
+ * Runs a full job and returns its wall time in seconds.
+ */
+static double runJob(const MapReduceClient &client, const InputVec &inputVec, int threads,
+                     const JobOptions &options = JobOptions()) {
+    OutputVec outputVec;
+    double start = nowSeconds();
+    JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads, options);
+    waitForJob(job);
+    closeJobHandle(job);
+    return nowSeconds() - start;
+}
+
+static void deleteOutput(OutputVec &outputVec) {
+    for (const OutputPair &pair : outputVec) {
+        delete pair.first;
+        delete pair.second;
+    }
+}
+
+static void makeInput(int inputs, std::vector<VIndex> &values, InputVec &inputVec) {
+    values.reserve(inputs);
+    for (int i = 0; i < inputs; ++i) {
+        values.push_back(VIndex(i));
+        inputVec.push_back(InputPair(nullptr, &values.back()));
+    }
+}
+
+static int runEmitBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    double pairs = static_cast<double>(inputs) * pairsPerInput;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    printf("emit2 map-phase throughput: %d inputs x %d pairs\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %12s %12s %12s\n",
+           "threads", "free [s]", "free Mp/s", "locked [s]", "locked Mp/s", "contended %");
+    for (int threads : THREAD_LEVELS) {
+        EmitClient freeClient(pairsPerInput, nullptr);
+        runJob(freeClient, inputVec, threads);
+        double freeTime = freeClient.mapClock.seconds();
+
+        EmitClient lockedClient(pairsPerInput, &lock);
+        runJob(lockedClient, inputVec, threads);
+        double lockedTime = lockedClient.mapClock.seconds();
+        double contended = lockedClient.acquisitions.load() == 0 ? 0 :
+                           100.0 * lockedClient.contended.load() / lockedClient.acquisitions.load();
+
+        printf("%8d %12.4f %12.2f %12.4f %12.2f %12.2f\n", threads,
+               freeTime, pairs / freeTime / 1e6, lockedTime, pairs / lockedTime / 1e6, contended);
+    }
+    pthread_mutex_destroy(&lock);
+    return 0;
+}
+
+/**
+ * Runs the skewed job with and without work stealing and prints map, reduce and total times.
+ */
+static int runSkewBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+
+    printf("work stealing on skewed input: %d inputs x %d zipf pairs\n", inputs, pairsPerInput);
+    printf("%8s %10s %10s %10s %10s %10s %10s\n",
+           "threads", "map [s]", "reduce [s]", "total [s]", "map [s]", "reduce [s]", "total [s]");
+    printf("%8s %32s %32s\n", "", "stealing", "static blocks");
+    for (int threads : THREAD_LEVELS) {
+        JobOptions stealing;
+        SkewClient stealingClient(inputs, pairsPerInput);
+        double stealingTotal = runJob(stealingClient, inputVec, threads, stealing);
+
+        JobOptions staticBlocks;
+        staticBlocks.workStealing = false;
+        SkewClient staticClient(inputs, pairsPerInput);
+        double staticTotal = runJob(staticClient, inputVec, threads, staticBlocks);
+
+        printf("%8d %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f\n", threads,
+               stealingClient.mapClock.seconds(), stealingClient.reduceClock.seconds(), stealingTotal,
+               staticClient.mapClock.seconds(), staticClient.reduceClock.seconds(), staticTotal);
+    }
+    return 0;
+}
+
+/**
+ * The skewed job with a reduce that counts the pairs of its key, and can merge partial counts so the
+ * framework may split the hot keys between threads.
+ */
+class HotKeyClient : public SkewClient {
+public:
+    HotKeyClient(int inputs, int pairsPerInput, bool splitHotKeys)
+            : SkewClient(inputs, pairsPerInput), splitHotKeys(splitHotKeys) {}
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        IntermediateSpan span = {pairs->data(), pairs->data() + pairs->size(), pairs};
+        reduce(span, context);
+    }
+
+    void reduce(const IntermediateSpan &pairs, void *context) const {
+        reduceClock.begin();
+        burn(static_cast<int>(pairs.size()) / 8 + 1);
+        emit3(new KWord(static_cast<const KWord *>(pairs[0].first)->word), new VCount(pairs.size()), context);
+        reduceClock.finish();
+    }
+
+    bool canMergePartials() const {
+        return splitHotKeys;
+    }
+
+    void mergePartials(const OutputVec *partials, void *context) const {
+        reduceClock.begin();
+        long count = 0;
+        for (const OutputPair &partial : *partials) {
+            count += static_cast<const VCount *>(partial.second)->count;
+            delete partial.first;
+            delete partial.second;
+        }
+        emit3(new KWord(static_cast<const KWord *>(partials->front().first)->word), new VCount(count), context);
+        reduceClock.finish();
+    }
+
+    bool splitHotKeys;
+};
+
+/**
+ * Runs the skewed job with whole groups and with the hot keys split between threads, and prints the
+ * reduce phase time and the skew statistics of getJobStats.
+ */
+static int runHotKeyBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+
+    printf("whole groups vs split hot keys: %d inputs x %d zipf pairs\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %10s %14s %8s %8s\n",
+           "threads", "whole [s]", "split [s]", "speedup", "largest group", "split", "parts");
+    for (int threads : THREAD_LEVELS) {
+        HotKeyClient wholeClient(inputs, pairsPerInput, false);
+        OutputVec wholeOutput;
+        closeJobHandle(startMapReduceJob(wholeClient, inputVec, wholeOutput, threads));
+        deleteOutput(wholeOutput);
+
+        HotKeyClient splitClient(inputs, pairsPerInput, true);
+        OutputVec splitOutput;
+        JobHandle job = startMapReduceJob(splitClient, inputVec, splitOutput, threads);
+        waitForJob(job);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+        deleteOutput(splitOutput);
+
+        double wholeTime = wholeClient.reduceClock.seconds();
+        double splitTime = splitClient.reduceClock.seconds();
+        printf("%8d %12.4f %12.4f %10.2f %14lu %8lu %8lu\n", threads, wholeTime, splitTime, wholeTime / splitTime,
+               stats.largestGroupPairs, stats.splitGroups, stats.groupParts);
+    }
+    return 0;
+}
+
+/**
+ * The skewed job with cheap map calls and the Zipf ranks reversed, so the largest groups have the
+ * largest keys and come last in key order.
+ */
+class LastHotKeyClient : public SkewClient {
+public:
+    LastHotKeyClient(int inputs, int pairsPerInput) : SkewClient(inputs, pairsPerInput) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        int index = static_cast<const VIndex *>(value)->index;
+        for (int i = 0; i < pairsPerInput; ++i) {
+            emit2(keys[KEY_COUNT - 1 - zipfKeys[(index * 131 + i * 17) % ZIPF_TABLE_SIZE]], one, context);
+        }
+    }
+};
+
+/**
+ * Runs reduce over groups whose largest ones come last in key order, with groups queued in key order
+ * and largest first, with work stealing and with static blocks, and prints the reduce phase makespan.
+ */
+static int runLptBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+
+    printf("reduce makespan, key order vs largest first: %d inputs x %d zipf pairs\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %10s %12s %12s %10s\n",
+           "threads", "key [s]", "largest [s]", "speedup", "key [s]", "largest [s]", "speedup");
+    printf("%8s %36s %36s\n", "", "stealing", "static blocks");
+    for (int threads : THREAD_LEVELS) {
+        double makespans[4];
+        for (int run = 0; run < 4; ++run) {
+            JobOptions options;
+            options.workStealing = run < 2;
+            options.largestGroupsFirst = run % 2 == 1;
+            LastHotKeyClient client(inputs, pairsPerInput);
+            runJob(client, inputVec, threads, options);
+            makespans[run] = client.reduceClock.seconds();
+        }
+        printf("%8d %12.4f %12.4f %10.2f %12.4f %12.4f %10.2f\n", threads,
+               makespans[0], makespans[1], makespans[0] / makespans[1],
+               makespans[2], makespans[3], makespans[2] / makespans[3]);
+    }
+    return 0;
+}
+
+/**
+ * Runs the skewed job with static blocks, so the thread holding the expensive inputs maps long after
+ * the others, once with the sampled parallel shuffle and once pipelined. The time after map is the
+ * job time left once the last map call returned.
+ */
+static int runPipelineBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+
+    printf("shuffle after map vs pipelined: %d inputs x %d zipf pairs, static blocks\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %12s %12s\n", "threads", "after map", "total [s]", "after map", "total [s]");
+    printf("%8s %25s %25s\n", "", "parallel shuffle", "pipelined");
+    for (int threads : THREAD_LEVELS) {
+        JobOptions shuffled;
+        shuffled.workStealing = false;
+        SkewClient shuffledClient(inputs, pairsPerInput);
+        double shuffledTotal = runJob(shuffledClient, inputVec, threads, shuffled);
+
+        JobOptions pipelined = shuffled;
+        pipelined.pipelined = true;
+        SkewClient pipelinedClient(inputs, pairsPerInput);
+        double pipelinedTotal = runJob(pipelinedClient, inputVec, threads, pipelined);
+
+        printf("%8d %12.4f %12.4f %12.4f %12.4f\n", threads,
+               shuffledTotal - shuffledClient.mapClock.seconds(), shuffledTotal,
+               pipelinedTotal - pipelinedClient.mapClock.seconds(), pipelinedTotal);
+    }
+    return 0;
+}
+
+/**
+ * Runs batches of identical concurrent jobs on a pool sized to the machine, every job asking for
+ * all the workers, and prints the batch throughput and when the first and the last job finished.
+ */
+static int runJobsBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    int workers = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    initWorkerPool(workers);
+
+    printf("concurrent jobs on %d workers: %d inputs x %d zipf pairs per job\n", workers, inputs, pairsPerInput);
+    printf("%8s %10s %10s %12s %12s\n", "jobs", "total [s]", "jobs/s", "first [s]", "last [s]");
+    for (int jobs : JOB_LEVELS) {
+        std::deque<SkewClient> clients;
+        std::vector<OutputVec> outputs(jobs);
+        std::vector<JobHandle> handles;
+        double start = nowSeconds();
+        for (int i = 0; i < jobs; ++i) {
+            clients.emplace_back(inputs, pairsPerInput);
+            handles.push_back(startMapReduceJob(clients.back(), inputVec, outputs[i], workers));
+        }
+        for (JobHandle job : handles) {
+            waitForJob(job);
+            closeJobHandle(job);
+        }
+        double total = nowSeconds() - start;
+        double first = total, last = 0;
+        for (const SkewClient &client : clients) {
+            first = std::min(first, client.reduceClock.end.load() - start);
+            last = std::max(last, client.reduceClock.end.load() - start);
+        }
+        printf("%8d %10.4f %10.2f %12.4f %12.4f\n", jobs, total, jobs / total, first, last);
+    }
+    shutdownWorkerPool();
+    return 0;
+}
+
+/**
+ * Counts Zipf keys through the pointer API, heap-allocating every pair or taking it from the framework arena,
+ * and through MapReduceJob, which keeps keys and values by value. All clients map the same keys and reduce
+ * by summing.
+ */
+class CountClient : public MapReduceClient {
+public:
+    explicit CountClient(const SkewClient &keys, bool useArena = false) : keys(keys), useArena(useArena) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        int index = static_cast<const VIndex *>(value)->index;
+        for (int i = 0; i < keys.pairsPerInput; ++i) {
+            int word = keys.zipfKeys[(index * 131 + i * 17) % ZIPF_TABLE_SIZE];
+            if (useArena) {
+                emit2(arenaNew<KWord>(context, word), arenaNew<VCount>(context, 1), context);
+            } else {
+                emit2(new KWord(word), new VCount(1), context);
+            }
+        }
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        long count = 0;
+        for (const IntermediatePair &pair : *pairs) {
+            count += static_cast<const VCount *>(pair.second)->count;
+            if (!useArena) {
+                delete pair.first;
+                delete pair.second;
+            }
+        }
+        emit3(new KWord(static_cast<const KWord *>(pairs->front().first)->word), new VCount(count), context);
+    }
+
+    const SkewClient &keys;
+    bool useArena;
+};
+
+typedef MapReduceJob<int, int, int, long, int, long> TypedCount;
+
+struct TypedCountClient {
+    explicit TypedCountClient(const SkewClient &keys) : keys(keys) {}
+
+    void map(const int &key, const int &index, TypedCount::MapEmitter &emitter) const {
+        (void) key;
+        for (int i = 0; i < keys.pairsPerInput; ++i) {
+            emitter.emit(keys.zipfKeys[(index * 131 + i * 17) % ZIPF_TABLE_SIZE], 1);
+        }
+    }
+
+    void reduce(const int &word, const long *begin, const long *end, TypedCount::ReduceEmitter &emitter) const {
+        long count = 0;
+        for (const long *value = begin; value != end; ++value) {
+            count += *value;
+        }
+        emitter.emit(word, count);
+    }
+
+    const SkewClient &keys;
+};
+
+static int runTypedBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    TypedCount::InputVec typedInput;
+    for (int i = 0; i < inputs; ++i) {
+        typedInput.push_back(std::make_pair(i, i));
+    }
+    SkewClient keys(inputs, pairsPerInput);
+
+    printf("pointer API vs MapReduceJob: %d inputs x %d zipf pairs\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %10s\n", "threads", "pointer [s]", "typed [s]", "speedup");
+    for (int threads : THREAD_LEVELS) {
+        CountClient pointerClient(keys);
+        OutputVec outputVec;
+        double start = nowSeconds();
+        JobHandle job = startMapReduceJob(pointerClient, inputVec, outputVec, threads);
+        closeJobHandle(job);
+        double pointerTime = nowSeconds() - start;
+        deleteOutput(outputVec);
+
+        TypedCount::OutputVec typedOutput;
+        start = nowSeconds();
+        TypedCount::run(TypedCountClient(keys), typedInput, typedOutput, threads);
+        double typedTime = nowSeconds() - start;
+
+        printf("%8d %12.4f %12.4f %10.2f\n", threads, pointerTime, typedTime, pointerTime / typedTime);
+    }
+    return 0;
+}
+
+/**
+ * Runs the Zipf count with new/delete per pair and with arena allocation, and prints the arena statistics.
+ */
+static int runArenaBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    SkewClient keys(inputs, pairsPerInput);
+
+    printf("new/delete vs arena per pair: %d inputs x %d zipf pairs\n", inputs, pairsPerInput);
+    printf("%8s %12s %12s %10s %14s %12s\n", "threads", "malloc [s]", "arena [s]", "speedup", "allocations", "blocks [MB]");
+    for (int threads : THREAD_LEVELS) {
+        CountClient mallocClient(keys);
+        OutputVec mallocOutput;
+        double start = nowSeconds();
+        closeJobHandle(startMapReduceJob(mallocClient, inputVec, mallocOutput, threads));
+        double mallocTime = nowSeconds() - start;
+        deleteOutput(mallocOutput);
+
+        CountClient arenaClient(keys, true);
+        OutputVec arenaOutput;
+        start = nowSeconds();
+        JobHandle job = startMapReduceJob(arenaClient, inputVec, arenaOutput, threads);
+        waitForJob(job);
+        double arenaTime = nowSeconds() - start;
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+        deleteOutput(arenaOutput);
+
+        printf("%8d %12.4f %12.4f %10.2f %14lu %12.2f\n", threads, mallocTime, arenaTime, mallocTime / arenaTime,
+               stats.arenaAllocations, stats.arenaBlockBytes / 1e6);
+    }
+    return 0;
+}
+
+/**
+ * A key with a normalized prefix, so the framework radix sorts it.
+ */
+class KPrefixWord : public KWord {
+public:
+    explicit KPrefixWord(int word) : KWord(word) {}
+    virtual bool normalizedPrefix(uint64_t *prefix) const {
+        *prefix = static_cast<uint64_t>(word);
+        return true;
+    }
+    virtual bool prefixIsExact() const {
+        return true;
+    }
+};
+
+#define SORT_KEY_COUNT 65536
+
+/**
+ * Emits preallocated keys spread over SORT_KEY_COUNT words, so the job time is dominated by sorting.
+ */
+class SortClient : public MapReduceClient {
+public:
+    SortClient(int pairsPerInput, bool withPrefix) : pairsPerInput(pairsPerInput), one(new VCount(1)) {
+        for (int i = 0; i < SORT_KEY_COUNT; ++i) {
+            keys.push_back(withPrefix ? new KPrefixWord(i) : new KWord(i));
+        }
+    }
+
+    ~SortClient() {
+        for (KWord *key : keys) {
+            delete key;
+        }
+        delete one;
+    }
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        unsigned int index = static_cast<const VIndex *>(value)->index;
+        for (int i = 0; i < pairsPerInput; ++i) {
+            emit2(keys[(index * 2654435761u + i * 40503u) % SORT_KEY_COUNT], one, context);
+        }
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        (void) pairs;
+        (void) context;
+    }
+
+    int pairsPerInput;
+    std::vector<KWord *> keys;
+    VCount *one;
+};
+
+static int runRadixBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    SortClient compareClient(pairsPerInput, false);
+    SortClient radixClient(pairsPerInput, true);
+
+    printf("comparison sort vs radix sort of keys: %d inputs x %d pairs over %d keys\n",
+           inputs, pairsPerInput, SORT_KEY_COUNT);
+    printf("%8s %12s %12s %10s\n", "threads", "compare [s]", "radix [s]", "speedup");
+    for (int threads : THREAD_LEVELS) {
+        double compareTime = runJob(compareClient, inputVec, threads);
+        double radixTime = runJob(radixClient, inputVec, threads);
+        printf("%8d %12.4f %12.4f %10.2f\n", threads, compareTime, radixTime, compareTime / radixTime);
+    }
+    return 0;
+}
+
+/**
+ * Writes a (word, count) pair as its two numbers.
+ */
+class CountSerializer : public IntermediateSerializer {
+public:
+    void serialize(const K2 *key, const V2 *value, std::vector<char> &out) const {
+        int word = static_cast<const KWord *>(key)->word;
+        long count = static_cast<const VCount *>(value)->count;
+        const char *wordBytes = reinterpret_cast<const char *>(&word);
+        const char *countBytes = reinterpret_cast<const char *>(&count);
+        out.insert(out.end(), wordBytes, wordBytes + sizeof(word));
+        out.insert(out.end(), countBytes, countBytes + sizeof(count));
+    }
+
+    void deserialize(const char *data, size_t size, K2 **key, V2 **value) const {
+        (void) size;
+        int word;
+        long count;
+        memcpy(&word, data, sizeof(word));
+        memcpy(&count, data + sizeof(word), sizeof(count));
+        *key = new KWord(word);
+        *value = new VCount(count);
+    }
+};
+
+#define SPILL_BUDGET 1000000
+
+/**
+ * Counts words spread evenly over SORT_KEY_COUNT keys, so the groups and the output stay small
+ * and the memory of the job is its intermediate pairs.
+ */
+class UniformCountClient : public MapReduceClient {
+public:
+    explicit UniformCountClient(int pairsPerInput) : pairsPerInput(pairsPerInput) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        unsigned int index = static_cast<const VIndex *>(value)->index;
+        for (int i = 0; i < pairsPerInput; ++i) {
+            emit2(new KWord((index * 2654435761u + i * 40503u) % SORT_KEY_COUNT), new VCount(1), context);
+        }
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        long count = 0;
+        for (const IntermediatePair &pair : *pairs) {
+            count += static_cast<const VCount *>(pair.second)->count;
+            delete pair.second;
+        }
+        emit3(new KWord(static_cast<const KWord *>(pairs->front().first)->word), new VCount(count), context);
+        for (const IntermediatePair &pair : *pairs) {
+            delete pair.first;
+        }
+    }
+
+    int pairsPerInput;
+};
+
+/**
+ * Runs the uniform count in a child process, so its peak resident size is measured alone, and
+ * returns the peak in MB. With a budget the job spills above SPILL_BUDGET intermediate pairs.
+ */
+static double spillJobPeakMegabytes(int inputs, int pairsPerInput, int threads, bool withBudget,
+                                    double *seconds) {
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (child == 0) {
+        std::vector<VIndex> values;
+        InputVec inputVec;
+        makeInput(inputs, values, inputVec);
+        UniformCountClient client(pairsPerInput);
+        CountSerializer serializer;
+        JobOptions options;
+        if (withBudget) {
+            options.memoryBudget = SPILL_BUDGET;
+            options.serializer = &serializer;
+        }
+        OutputVec outputVec;
+        double start = nowSeconds();
+        closeJobHandle(startMapReduceJob(client, inputVec, outputVec, threads, options));
+        double elapsed = nowSeconds() - start;
+        deleteOutput(outputVec);
+        if (write(pipeFds[1], &elapsed, sizeof(elapsed)) != sizeof(elapsed)) {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(pipeFds[1]);
+    if (read(pipeFds[0], seconds, sizeof(*seconds)) != sizeof(*seconds)) {
+        *seconds = 0;
+    }
+    close(pipeFds[0]);
+    int status;
+    struct rusage usage;
+    wait4(child, &status, 0, &usage);
+    return usage.ru_maxrss / 1024.0;
+}
+
+/**
+ * Runs growing uniform counts with and without a memory budget and prints the peak resident size of each,
+ * which should stay flat with the budget while the input grows.
+ */
+static int runSpillBenchmark(int inputs, int pairsPerInput) {
+    const int threads = 4;
+    printf("peak memory with and without a budget of %d pairs: x %d pairs over %d keys, %d threads\n",
+           SPILL_BUDGET, pairsPerInput, SORT_KEY_COUNT, threads);
+    printf("%10s %12s %12s %12s %12s\n", "inputs", "memory [s]", "memory [MB]", "spill [s]", "spill [MB]");
+    for (int scale = 1; scale <= 16; scale *= 2) {
+        double memoryTime;
+        double spillTime;
+        double memoryPeak = spillJobPeakMegabytes(inputs * scale, pairsPerInput, threads, false, &memoryTime);
+        double spillPeak = spillJobPeakMegabytes(inputs * scale, pairsPerInput, threads, true, &spillTime);
+        printf("%10d %12.4f %12.1f %12.4f %12.1f\n", inputs * scale, memoryTime, memoryPeak, spillTime, spillPeak);
+    }
+    return 0;
+}
+
+class VString : public V1 {
+public:
+    explicit VString(const std::string &content) : content(content) {}
+    std::string content;
+};
+
+/**
+ * Hashes every line and emits nothing, so the timing is the cost of getting the lines to map. Reads
+ * copied VStrings or LineViews into the mapped file.
+ */
+class LineHashClient : public MapReduceClient {
+public:
+    explicit LineHashClient(bool zeroCopy) : zeroCopy(zeroCopy) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        (void) context;
+        const char *data;
+        size_t size;
+        if (zeroCopy) {
+            data = static_cast<const LineView *>(value)->data;
+            size = static_cast<const LineView *>(value)->size;
+        } else {
+            data = static_cast<const VString *>(value)->content.data();
+            size = static_cast<const VString *>(value)->content.size();
+        }
+        unsigned int hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        hashes.fetch_add(hash == 0, std::memory_order_relaxed);
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        (void) pairs;
+        (void) context;
+    }
+
+    bool zeroCopy;
+    mutable std::atomic<unsigned long> hashes{0};
+};
+
+/**
+ * Writes a file of lines, then maps it once read into VStrings with getline (load time included)
+ * and once through MappedLineSource.
+ */
+static int runLinesBenchmark(int lines, int lineLength) {
+    char path[] = "/tmp/MapReduceBenchmarkXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    {
+        std::ofstream file(path);
+        std::string line;
+        for (int i = 0; i < lines; ++i) {
+            line.assign(lineLength, 'a' + i % 26);
+            file << line << '\n';
+        }
+    }
+
+    printf("VString copies vs MappedLineSource: %d lines of %d bytes\n", lines, lineLength);
+    printf("%8s %12s %12s %10s\n", "threads", "copy [s]", "mmap [s]", "speedup");
+    for (int threads : THREAD_LEVELS) {
+        double start = nowSeconds();
+        std::vector<VString> values;
+        InputVec inputVec;
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            values.push_back(VString(line));
+        }
+        for (VString &value : values) {
+            inputVec.push_back(InputPair(nullptr, &value));
+        }
+        LineHashClient copyClient(false);
+        OutputVec copyOutput;
+        closeJobHandle(startMapReduceJob(copyClient, inputVec, copyOutput, threads));
+        double copyTime = nowSeconds() - start;
+
+        start = nowSeconds();
+        MappedLineSource source(std::vector<std::string>(1, path));
+        LineHashClient mappedClient(true);
+        OutputVec mappedOutput;
+        closeJobHandle(startMapReduceJob(mappedClient, source, mappedOutput, threads));
+        double mappedTime = nowSeconds() - start;
+
+        printf("%8d %12.4f %12.4f %10.2f\n", threads, copyTime, mappedTime, copyTime / mappedTime);
+    }
+    unlink(path);
+    return 0;
+}
+
+/**
+ * A word and its count, the output of one stage of a chain and the input of the next.
+ */
+class KChainWord : public K1, public K2, public K3 {
+public:
+    explicit KChainWord(long word) : word(word) {}
+    virtual bool operator<(const K1 &other) const {
+        return word < static_cast<const KChainWord &>(other).word;
+    }
+    virtual bool operator<(const K2 &other) const {
+        return word < static_cast<const KChainWord &>(other).word;
+    }
+    virtual bool operator<(const K3 &other) const {
+        return word < static_cast<const KChainWord &>(other).word;
+    }
+    long word;
+};
+
+class VChainCount : public V1, public V2, public V3 {
+public:
+    explicit VChainCount(long count) : count(count) {}
+    long count;
+};
+
+#define CHAIN_WORDS 65536
+#define CHAIN_STAGES 3
+
+/**
+ * One stage of a chain of word counts. The first stage counts pairsPerInput of CHAIN_WORDS words per
+ * input, every later stage folds the words two by two and sums their counts.
+ */
+class ChainClient : public MapReduceClient {
+public:
+    explicit ChainClient(int pairsPerInput) : pairsPerInput(pairsPerInput) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        if (key == nullptr) {
+            int index = static_cast<const VIndex *>(value)->index;
+            for (int i = 0; i < pairsPerInput; ++i) {
+                emit2(new KChainWord((index * 2654435761UL + i * 40503UL) % CHAIN_WORDS), new VChainCount(1), context);
+            }
+            return;
+        }
+        emit2(new KChainWord(static_cast<const KChainWord *>(key)->word / 2),
+              new VChainCount(static_cast<const VChainCount *>(value)->count), context);
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        long word = static_cast<const KChainWord *>(pairs->front().first)->word;
+        long count = 0;
+        for (const IntermediatePair &pair : *pairs) {
+            count += static_cast<const VChainCount *>(pair.second)->count;
+            delete pair.first;
+            delete pair.second;
+        }
+        emit3(new KChainWord(word), new VChainCount(count), context);
+    }
+
+    int pairsPerInput;
+};
+
+static void handOffChainPair(K3 *key, V3 *value, K1 **inputKey, V1 **inputValue) {
+    *inputKey = static_cast<KChainWord *>(key);
+    *inputValue = static_cast<VChainCount *>(value);
+}
+
+static void releaseChainPair(K1 *key, V1 *value) {
+    delete key;
+    delete value;
+}
+
+static long sumChainCounts(const OutputVec &outputVec) {
+    long total = 0;
+    for (const OutputPair &pair : outputVec) {
+        total += static_cast<const VChainCount *>(pair.second)->count;
+    }
+    return total;
+}
+
+/**
+ * Runs a chain of CHAIN_STAGES word counts, once as separate jobs that wait for each other and rebuild
+ * an InputVec from every OutputVec, and once as a JobGraph that hands the pairs over in memory.
+ */
+static int runDagBenchmark(int inputs, int pairsPerInput) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    ChainClient client(pairsPerInput);
+
+    printf("chain of %d stages, separate jobs vs JobGraph: %d inputs x %d pairs over %d words\n",
+           CHAIN_STAGES, inputs, pairsPerInput, CHAIN_WORDS);
+    printf("%8s %12s %12s %10s\n", "threads", "jobs [s]", "graph [s]", "speedup");
+    for (int threads : THREAD_LEVELS) {
+        double start = nowSeconds();
+        OutputVec outputVec;
+        InputVec stageInput;
+        for (int stage = 0; stage < CHAIN_STAGES; ++stage) {
+            outputVec.clear();
+            JobHandle job = startMapReduceJob(client, stage == 0 ? inputVec : stageInput, outputVec, threads);
+            closeJobHandle(job);
+            for (const InputPair &pair : stageInput) {
+                releaseChainPair(pair.first, pair.second);
+            }
+            stageInput.clear();
+            if (stage + 1 < CHAIN_STAGES) {
+                for (const OutputPair &pair : outputVec) {
+                    stageInput.push_back(InputPair(nullptr, nullptr));
+                    handOffChainPair(pair.first, pair.second, &stageInput.back().first, &stageInput.back().second);
+                }
+            }
+        }
+        double jobsTime = nowSeconds() - start;
+        long jobsTotal = sumChainCounts(outputVec);
+        deleteOutput(outputVec);
+
+        start = nowSeconds();
+        long graphTotal;
+        {
+            JobGraph graph;
+            int stage = graph.addStage(client, inputVec, threads);
+            for (int i = 1; i < CHAIN_STAGES; ++i) {
+                stage = graph.addStage(client, std::vector<int>(1, stage), handOffChainPair, releaseChainPair, threads);
+            }
+            graph.start();
+            graph.wait();
+            graphTotal = sumChainCounts(graph.getOutput(stage));
+            deleteOutput(graph.getOutput(stage));
+        }
+        double graphTime = nowSeconds() - start;
+        if (jobsTotal != graphTotal) {
+            fprintf(stderr, "chain outputs differ: %ld vs %ld\n", jobsTotal, graphTotal);
+            return 1;
+        }
+        printf("%8d %12.4f %12.4f %10.2f\n", threads, jobsTime, graphTime, jobsTime / graphTime);
+    }
+    return 0;
+}
+
+/**
+ * Runs the skewed job once and prints the per-thread breakdown of getJobStats, in milliseconds.
+ */
+static int runStatsBenchmark(int inputs, int pairsPerInput, int threads) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+    SkewClient client(inputs, pairsPerInput);
+    OutputVec outputVec;
+    double start = nowSeconds();
+    JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads);
+    waitForJob(job);
+    double total = nowSeconds() - start;
+    JobStats stats;
+    getJobStats(job, &stats);
+    closeJobHandle(job);
+
+    printf("per-thread breakdown of the skewed job: %d inputs x %d zipf pairs, %d threads, %.4f s\n",
+           inputs, pairsPerInput, threads, total);
+    printf("%6s %15s %15s %15s %8s %8s %8s %9s %7s\n", "thread", "map wall/cpu", "shuffle wall/cpu",
+           "reduce wall/cpu", "sort", "barrier", "locks", "emitted", "groups");
+    for (size_t i = 0; i < stats.threads.size(); ++i) {
+        const ThreadStats &thread = stats.threads[i];
+        printf("%6zu %7.2f/%7.2f %7.2f/%7.2f %7.2f/%7.2f %8.2f %8.2f %8.3f %9lu %7lu\n", i,
+               thread.map.wallNanos / 1e6, thread.map.cpuNanos / 1e6,
+               thread.shuffle.wallNanos / 1e6, thread.shuffle.cpuNanos / 1e6,
+               thread.reduce.wallNanos / 1e6, thread.reduce.cpuNanos / 1e6,
+               thread.sortNanos / 1e6, thread.barrierWaitNanos / 1e6, thread.lockWaitNanos / 1e6,
+               thread.emittedPairs, thread.reducedGroups);
+    }
+    return 0;
+}
+
+/**
+ * Runs the skewed job with tracing off and on, prints the job times, and leaves the trace of the last
+ * traced run in the given file.
+ */
+static int runTraceBenchmark(int inputs, int pairsPerInput, const char *path) {
+    std::vector<VIndex> values;
+    InputVec inputVec;
+    makeInput(inputs, values, inputVec);
+
+    printf("tracing off vs on: %d inputs x %d zipf pairs, trace written to %s\n", inputs, pairsPerInput, path);
+    printf("%8s %12s %12s %10s\n", "threads", "off [s]", "on [s]", "overhead");
+    for (int threads : THREAD_LEVELS) {
+        SkewClient plainClient(inputs, pairsPerInput);
+        double plainTime = runJob(plainClient, inputVec, threads);
+
+        JobOptions traced;
+        traced.tracePath = path;
+        SkewClient tracedClient(inputs, pairsPerInput);
+        double tracedTime = runJob(tracedClient, inputVec, threads, traced);
+        printf("%8d %12.4f %12.4f %9.1f%%\n", threads, plainTime, tracedTime,
+               (tracedTime / plainTime - 1) * 100);
+    }
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s emit [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s skew [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s jobs [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s typed [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s arena [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s radix [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s spill [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s lines [lines] [lineLength]\n", program);
+    fprintf(stderr, "       %s pipeline [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s hotkey [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s lpt [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s dag [inputs] [pairsPerInput]\n", program);
+    fprintf(stderr, "       %s stats [inputs] [pairsPerInput] [threads]\n", program);
+    fprintf(stderr, "       %s trace [inputs] [pairsPerInput] [path]\n", program);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (strcmp(argv[1], "emit") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 100;
+        return runEmitBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "skew") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 20;
+        return runSkewBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "jobs") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 5000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 20;
+        return runJobsBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "typed") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runTypedBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "arena") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runArenaBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "radix") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runRadixBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "spill") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 100;
+        return runSpillBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "lines") == 0) {
+        int lines = argc > 2 ? atoi(argv[2]) : 2000000;
+        int lineLength = argc > 3 ? atoi(argv[3]) : 80;
+        return runLinesBenchmark(lines, lineLength);
+    }
+    if (strcmp(argv[1], "pipeline") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runPipelineBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "hotkey") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runHotKeyBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "lpt") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 50;
+        return runLptBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "dag") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 20;
+        return runDagBenchmark(inputs, pairsPerInput);
+    }
+    if (strcmp(argv[1], "stats") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 20;
+        int threads = argc > 4 ? atoi(argv[4]) : 8;
+        return runStatsBenchmark(inputs, pairsPerInput, threads);
+    }
+    if (strcmp(argv[1], "trace") == 0) {
+        int inputs = argc > 2 ? atoi(argv[2]) : 20000;
+        int pairsPerInput = argc > 3 ? atoi(argv[3]) : 20;
+        const char *path = argc > 4 ? argv[4] : "mapreduce_trace.json";
+        return runTraceBenchmark(inputs, pairsPerInput, path);
+    }
+    usage(argv[0]);
+    return 1;
+}
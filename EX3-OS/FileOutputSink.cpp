@@ -0,0 +1,93 @@
+#include "FileOutputSink.h"
+#include <cstdlib>
+
+/**
+ * Creates the output file, an existing file is truncated.
+ * @param path - the output file.
+ * @param format - appends the text of one output pair.
+ * @param deletePairs - whether to delete every pair once it was formatted.
+ * @param bufferBytes - the bytes a thread buffers before it writes to the file.
+ */
+FileOutputSink::FileOutputSink(const std::string &path, Formatter format, bool deletePairs, size_t bufferBytes)
+        : file(fopen(path.c_str(), "w")), format(format), deletePairs(deletePairs), bufferBytes(bufferBytes),
+          mutex(PTHREAD_MUTEX_INITIALIZER) {
+    if (file == nullptr) {
+        fprintf(stdout, "system error: Unable to create output file %s.\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+}
+
+FileOutputSink::~FileOutputSink() {
+    if (fclose(file) != 0) {
+        fprintf(stdout, "system error: Unable to close an output file.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_mutex_destroy(&mutex) != 0) {
+        fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Gives every job thread an empty buffer.
+ * @param threadCount - the number of job threads.
+ */
+void FileOutputSink::open(int threadCount) {
+    buffers.assign(threadCount, Buffer());
+}
+
+/**
+ * Formats a pair into the buffer of the thread, and writes the buffer once it is full.
+ */
+void FileOutputSink::write(int threadId, K3 *key, V3 *value) {
+    Buffer &buffer = buffers[threadId];
+    format(key, value, buffer.data);
+    if (deletePairs) {
+        delete key;
+        delete value;
+    }
+    if (buffer.data.size() >= bufferBytes) {
+        writeBuffer(buffer);
+    }
+}
+
+/**
+ * Writes what is left in the buffer of a thread that finished reducing.
+ */
+void FileOutputSink::flush(int threadId) {
+    writeBuffer(buffers[threadId]);
+}
+
+/**
+ * Flushes the file once all threads wrote their buffers.
+ */
+void FileOutputSink::close() {
+    if (fflush(file) != 0) {
+        fprintf(stdout, "system error: Unable to write an output file.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Appends a buffer to the file under the file lock, so the records of a buffer stay together.
+ * @param buffer - the buffer, empty afterwards.
+ */
+void FileOutputSink::writeBuffer(Buffer &buffer) {
+    if (buffer.data.empty()) {
+        return;
+    }
+    if (pthread_mutex_lock(&mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock output file mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    size_t written = fwrite(buffer.data.data(), 1, buffer.data.size(), file);
+    if (pthread_mutex_unlock(&mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock output file mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (written != buffer.data.size()) {
+        fprintf(stdout, "system error: Unable to write an output file.\n");
+        exit(EXIT_FAILURE);
+    }
+    buffer.data.clear();
+}
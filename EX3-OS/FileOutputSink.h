@@ -0,0 +1,46 @@
+#ifndef FILEOUTPUTSINK_H
+#define FILEOUTPUTSINK_H
+
+#include "MapReduceClient.h"
+#include <vector>    //std::vector
+#include <string>    //std::string
+#include <cstdio>    //FILE
+#include <pthread.h>
+
+// an OutputSink that writes the output pairs to one file as text. Every job
+// thread formats its pairs into its own buffer and appends the buffer to the
+// file when it holds bufferBytes, so threads only share the file lock once per
+// buffer. Records of different threads are not ordered.
+class FileOutputSink : public OutputSink {
+public:
+	// appends the text of one output pair, usually ending with a line break
+	typedef void (*Formatter)(const K3* key, const V3* value, std::string& out);
+
+	// deletePairs deletes every pair once it was formatted
+	FileOutputSink(const std::string& path, Formatter format, bool deletePairs = true,
+			size_t bufferBytes = 1 << 16);
+	virtual ~FileOutputSink();
+	virtual void open(int threadCount);
+	virtual void write(int threadId, K3* key, V3* value);
+	virtual void flush(int threadId);
+	virtual void close();
+
+private:
+	struct Buffer {
+		std::string data;
+		// keeps the buffers of two threads off one cache line
+		char cacheLinePadding[64];
+	};
+
+	void writeBuffer(Buffer& buffer);
+
+	FILE* file;
+	Formatter format;
+	bool deletePairs;
+	size_t bufferBytes;
+	std::vector<Buffer> buffers;
+	pthread_mutex_t mutex;
+};
+
+
+#endif //FILEOUTPUTSINK_H
@@ -3,6 +3,8 @@
 
 #include <vector>  //std::vector
 #include <utility> //std::pair
+#include <cstddef> //size_t
+#include <cstdint> //uint64_t
 
 // input key and value.
 // the key, value for the map function and the MapReduceFramework
@@ -23,6 +25,29 @@ class K2 {
 public:
 	virtual ~K2(){}
 	virtual bool operator<(const K2 &other) const = 0;
+
+	// optional key normalization, lets the framework radix sort the keys.
+	// a key that supports it stores in prefix an unsigned number whose order
+	// agrees with operator< (a < b implies prefix(a) <= prefix(b)) and returns
+	// true. All keys of a job must agree on whether they have a prefix.
+	// prefixIsExact tells that equal prefixes mean equal keys (e.g. integer
+	// keys), so pairs with equal prefixes are not compared with operator<.
+	virtual bool normalizedPrefix(uint64_t* prefix) const {
+		(void) prefix;
+		return false;
+	}
+	virtual bool prefixIsExact() const { return false; }
+};
+
+// an intermediate key the hash shuffle can group, the keys of a job that uses
+// HASH_SHUFFLE must derive from it.
+class HashedK2 : public K2 {
+public:
+	// keys that are equal must have equal hashes
+	virtual size_t hash() const = 0;
+	virtual bool operator==(const K2 &other) const {
+		return !(*this < other) && !(other < *this);
+	}
 };
 
 class V2 {
@@ -51,6 +76,103 @@ typedef std::vector<InputPair> InputVec;
 typedef std::vector<IntermediatePair> IntermediateVec;
 typedef std::vector<OutputPair> OutputVec;
 
+// a read-only view of consecutive intermediate pairs, lets reduce read a group
+// in place without copying it
+struct IntermediateSpan {
+	const IntermediatePair* first;
+	const IntermediatePair* last;
+	// the vector holding exactly these pairs, or nullptr when the view is a
+	// part of a vector (a part of a split group)
+	const IntermediateVec* whole;
+
+	const IntermediatePair* begin() const { return first; }
+	const IntermediatePair* end() const { return last; }
+	size_t size() const { return last - first; }
+	bool empty() const { return first == last; }
+	const IntermediatePair& operator[](size_t i) const { return first[i]; }
+};
+
+// a stream of input pairs that the map threads pull in splits while the job
+// runs, instead of an InputVec filled before the job starts.
+class InputSource {
+public:
+	virtual ~InputSource() {}
+
+	// appends up to maxPairs next input pairs to the empty split, returns false
+	// once the input ran out. Called by many map threads at once.
+	virtual bool nextSplit(InputVec& split, size_t maxPairs) = 0;
+
+	// called when all pairs of a split were mapped, so their K1/V1 may be freed.
+	virtual void releaseSplit(InputVec& split) {
+		(void) split;
+	}
+
+	// the number of input pairs, or at least an upper bound on it, used for the
+	// progress of getJobState. 0 when unknown, map progress then stays at 0%.
+	// A source may count its input in another unit (e.g. bytes) when
+	// splitProgress counts its splits in the same unit.
+	virtual unsigned long sizeHint() const {
+		return 0;
+	}
+
+	// the part of sizeHint a split filled by nextSplit stands for, called
+	// after the split was mapped and before releaseSplit. The default counts
+	// its pairs.
+	virtual unsigned long splitProgress(const InputVec& split) const {
+		return split.size();
+	}
+};
+
+// receives the output pairs of a job while reduce emits them, instead of the
+// OutputVec. Every job thread writes through its own threadId in
+// [0, threadCount): calls with the same threadId never run at once, calls with
+// different ones do.
+class OutputSink {
+public:
+	virtual ~OutputSink() {}
+
+	// called once when the job starts, before any write.
+	virtual void open(int threadCount) {
+		(void) threadCount;
+	}
+
+	// takes an output pair emitted with emit3, the sink owns it from now on.
+	virtual void write(int threadId, K3* key, V3* value) = 0;
+
+	// called once when the thread finished reducing, nothing is written
+	// through threadId afterwards.
+	virtual void flush(int threadId) {
+		(void) threadId;
+	}
+
+	// called once after every thread flushed, before the job is done.
+	virtual void close() {}
+};
+
+// writes intermediate pairs to bytes and reads them back, lets the framework
+// spill pairs to disk when a job exceeds JobOptions::memoryBudget.
+class IntermediateSerializer {
+public:
+	virtual ~IntermediateSerializer() {}
+
+	// appends the bytes of the pair to out.
+	virtual void serialize(const K2* key, const V2* value,
+			std::vector<char>& out) const = 0;
+
+	// rebuilds a pair from the size bytes one serialize call wrote. The new
+	// key and value reach reduce like any emitted pair.
+	virtual void deserialize(const char* data, size_t size,
+			K2** key, V2** value) const = 0;
+
+	// frees a pair once it was written to disk, the default deletes both. A
+	// key or value allocated with allocateIntermediate is passed as nullptr,
+	// the framework frees the arena itself.
+	virtual void release(K2* key, V2* value) const {
+		delete key;
+		delete value;
+	}
+};
+
 
 class MapReduceClient {
 public:
@@ -60,8 +182,54 @@ public:
 
 	// gets a single K2 key and a vector of all its respective V2 values
 	// calls emit3(K3, V3, context) any number of times (usually once)
-	// to output (K3, V3) pairs.
+	// to output (K3, V3) pairs. The vector is the group itself, read in place.
 	virtual void reduce(const IntermediateVec* pairs, void* context) const = 0;
+
+	// same as above, with the pairs given as a view into framework memory.
+	// The framework calls this one for every group and every part of a split
+	// group (see canMergePartials). The default passes a whole group to the
+	// function above in place and copies only a part into a vector, a client
+	// may override it to read every group and part in place. A client that
+	// overrides one of the two should add `using MapReduceClient::reduce;` to
+	// its class, so the other one is not hidden (-Woverloaded-virtual).
+	virtual void reduce(const IntermediateSpan& pairs, void* context) const {
+		if (pairs.whole != nullptr) {
+			reduce(pairs.whole, context);
+			return;
+		}
+		IntermediateVec vec(pairs.begin(), pairs.end());
+		reduce(&vec, context);
+	}
+
+	// optional map-side combiner, used only when hasCombiner returns true.
+	// gets pairs of one K2 key emitted by the same thread and calls
+	// emit2(K2, V2, context) any number of times (usually once) to replace
+	// them. The given pairs are not used by the framework afterwards.
+	virtual bool hasCombiner() const { return false; }
+	virtual void combine(const IntermediateVec* pairs, void* context) const {
+		(void) pairs;
+		(void) context;
+	}
+
+	// estimated cost of reducing pairCount pairs of key, used to reduce the
+	// expensive groups first when JobOptions::largestGroupsFirst is set.
+	virtual unsigned long reduceCost(const K2* key, size_t pairCount) const {
+		(void) key;
+		return pairCount;
+	}
+
+	// optional merge of partial results, used only when canMergePartials
+	// returns true. It lets the framework split a huge group between threads:
+	// reduce then gets consecutive parts of the pairs of one key, and the
+	// (K3, V3) pairs it emits for a part are a partial result. mergePartials
+	// gets the partial results of two neighbouring parts and calls emit3 to
+	// emit their merged result, which may be merged again. The merge must be
+	// associative. The partial pairs are not used by the framework afterwards.
+	virtual bool canMergePartials() const { return false; }
+	virtual void mergePartials(const OutputVec* partials, void* context) const {
+		(void) partials;
+		(void) context;
+	}
 };
 
 
@@ -2,462 +2,2676 @@
 // Created by ybarak on 27/06/2024.
 //
 #include "MapReduceFramework.h"
+#include "ShuffleMerge.h"
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
 #include <atomic>
 #include <list>
 #include <algorithm>
+#include <unordered_map>
+#include <deque>
+#include <iterator>
+#include <functional>
+#include <ctime>
 #include <pthread.h>
 #include <unistd.h>
 
+// the progress word holds the stage above STAGE_SHIFT, the processed count of the stage above
+// PROCESSED_SHIFT and the total count of the stage in the low bits
+#define INDEX_MASK 0x7fffffffUL
+#define PROCESSED_SHIFT 31
+#define STAGE_SHIFT 62
+
+// with an adaptive grain a thread takes 1 / GUIDED_FACTOR of the items left in its own queue
+#define GUIDED_FACTOR 4
+
+// time a slot runs before it gives its worker to another job that waits, in nanoseconds
+#define SLOT_QUANTUM_NS 2000000
+
+// size of the arena blocks, allocations above a quarter of it get a block of their own
+#define ARENA_BLOCK_SIZE 65536
+// arena allocations are rounded up to this, which keeps them aligned for any fundamental type
+#define ARENA_ALIGNMENT 16
+
+// below this many pairs keys are sorted by comparison even when they have a normalized prefix
+#define RADIX_SORT_MIN_PAIRS 256
+#define RADIX_BITS 8
+#define RADIX_PASSES 8
+
+// spill files are written in chunks of about this many bytes
+#define SPILL_BUFFER_SIZE (1 << 20)
+
+// spill runs a slot keeps open at most; past it the smallest SPILL_MERGE_FAN_IN runs are merged into one
+#define MAX_SPILL_RUNS 16
+#define SPILL_MERGE_FAN_IN 8
+
+// input pairs a thread pulls from an InputSource at once when the grain is adaptive
+#define SOURCE_SPLIT_PAIRS 256
+
+// reduce slots take groups from a streaming merge in batches of about this many pairs
+#define MERGE_BATCH_PAIRS 1024
+
+// groups are split into parts of at least this many pairs
+#define MIN_SPLIT_GROUP_PAIRS 1024
+
 struct JobContext;
 struct ThreadContext;
+struct StageChannel;
+struct MergeSource;
+struct Arena;
 
 // helper functions
-void *threadRun(void *_arg);
+void *workerRun(void *_arg);
+
+void runSlot(ThreadContext *threadContext);
+
+void scheduleSlots(JobContext *jobContext);
+
+void finishSlot(ThreadContext *threadContext);
+
+JobContext *newJobContext(const MapReduceClient *client, const InputVec *inputVec, OutputVec *outputVec,
+                          int multiThreadLevel, const JobOptions &options);
+
+void submitJob(JobContext *jobContext);
+
+void yieldSlot(ThreadContext *threadContext);
 
-unsigned long getInputPairIndex(ThreadContext *threadContext);
+bool sliceExpired(ThreadContext *threadContext);
 
-void processInputPair(ThreadContext *threadContext, unsigned long index);
+bool claimRange(ThreadContext *threadContext, unsigned long *begin, unsigned long *end);
 
-void reducePair(ThreadContext *threadContext, IntermediateVec curPair);
+void distributeTasks(JobContext *jobContext, unsigned long itemCount);
+
+uint64_t packProgress(stage_t stage, unsigned long processedItems, unsigned long totalItems);
+
+void reportProgress(ThreadContext *threadContext, unsigned long processedItems);
+
+void processInputPair(ThreadContext *threadContext, const K1 *key, const V1 *value);
+
+bool mapSourceSplits(ThreadContext *threadContext);
+
+bool mapChannelSplits(ThreadContext *threadContext);
+void addChannelProgress(JobContext *jobContext, unsigned long processedItems, long addedItems);
+
+void wakeSlots(const std::vector<ThreadContext *> &slots);
+
+void addToCounter(std::atomic<unsigned long> &counter, unsigned long amount);
+
+uint64_t nowNanos();
+
+uint64_t traceBegin(ThreadContext *threadContext);
+
+void traceEnd(ThreadContext *threadContext, const char *name, uint64_t start, unsigned long items);
+
+void writeTrace(JobContext *jobContext);
+
+void lockChannel(StageChannel *channel);
+
+void unlockChannel(StageChannel *channel);
+
+void reducePair(ThreadContext *threadContext, IntermediateVec &group);
 
 void executeShuffleOperation(JobContext *jobContext);
 
-void sortIntermediatePairsByKeys(ThreadContext *threadCtx);
+void mergeSpillRuns(ThreadContext *threadContext);
+
+bool advanceMergeSource(MergeSource &source, const IntermediateSerializer *serializer, std::vector<char> &record);
+
+void executeSerialShuffle(JobContext *jobContext);
+
+void configureShuffleEnvironment(JobContext *jobDetails);
+
+void sampleIntermediatePairs(ThreadContext *threadContext);
+
+void executeRangeShuffle(ThreadContext *threadContext);
+
+void executeHashShuffle(ThreadContext *threadContext);
+
+void combineIntermediatePairs(ThreadContext *threadContext);
+
+void updateShuffleProgress(JobContext *jobContext, unsigned long mergedPairs);
+
+void sortIntermediatePairsByKeys(IntermediateVec &pairs);
 
 void DestroyMutex(int checkReturnValue);
 
 void InitReduceStage(JobContext *jobContext);
 
-void waitFirstThread(JobContext *curJob);
+void spliceOutput(JobContext *jobContext);
+
+void releaseArenas(JobContext *jobContext);
+
+void resetArena(Arena &arena);
+
+void spillIntermediatePairs(ThreadContext *threadContext);
+
+void endMapStage(JobContext *jobContext);
+
+void startStreamingMerge(JobContext *jobContext);
+
+unsigned long pullMergedGroups(JobContext *jobContext, std::vector<IntermediateVec> &groups);
+
+void finishStreamingMerge(JobContext *jobContext);
+
+void mergeFinishedRuns(ThreadContext *threadContext);
+
+void splitLargeGroups(JobContext *jobContext, unsigned long groupCount, std::vector<bool> &groupIsSplit);
+
+void queueGroupParts(JobContext *jobContext, unsigned long groupCount, const std::vector<bool> &groupIsSplit);
+
+void queueLargestGroupsFirst(JobContext *jobContext, unsigned long groupCount,
+                             const std::vector<bool> &groupIsSplit);
+
+void reduceGroupPart(ThreadContext *threadContext, unsigned long partIndex);
 
 /**
-    a multiple use barrier
+    a multiple use barrier that never blocks, slots that arrive early are parked by their worker
  */
 class Barrier {
 public:
     explicit Barrier(int numThreads);
 
-    void barrier(JobContext *jobContext);
+    bool arrive(JobContext *jobContext, void (*lastArrival)(JobContext *));
+
+private:
+    std::atomic<int> count;
+    int numThreads;
+};
 
-    ~Barrier();
+/**
+ * The phase a job slot runs next, every phase ends at the job barrier.
+ */
+enum slot_phase_t {MAP_PHASE, SHUFFLE_PHASE, REDUCE_PHASE};
 
+/**
+ * A range of item indices [begin, end) of the current stage, input pairs in map and groups in reduce.
+ */
+struct TaskRange {
+    unsigned long begin;
+    unsigned long end;
+};
 
-private:
+/**
+ * The work queue of one thread in the current stage. The owner takes items from the front,
+ * idle threads steal from the back.
+ */
+struct TaskDeque {
     pthread_mutex_t mutex;
-    pthread_cond_t cv;
-    int count;
-    int numThreads;
+    std::deque<TaskRange> ranges;
+};
+
+/**
+ * A block of an arena and its size.
+ */
+struct ArenaBlock {
+    char *memory;
+    size_t size;
+};
+
+/**
+ * A bump allocator for intermediate keys and values of one slot. Memory is only released in bulk.
+ */
+struct Arena {
+    std::vector<ArenaBlock> blocks;
+    char *next;
+    char *end;
+};
+
+/**
+ * A span of work of one slot for the Chrome trace of a job, items is what the span processed (pairs,
+ * groups) or 0.
+ */
+struct TraceEvent {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    unsigned long items;
+};
+
+/**
+ * A sorted run of intermediate pairs in a temporary file, one record per pair: the length
+ * of the serialized pair, then its bytes.
+ */
+struct SpillRun {
+    FILE *file;
+    unsigned long pairCount;
+};
+
+/**
+ * A sorted run read by the streaming merge, either the in-memory pairs of a slot or a spill run.
+ */
+struct MergeSource {
+    const IntermediatePair *next;
+    const IntermediatePair *end;
+    // nullptr for in-memory pairs
+    FILE *file;
+    unsigned long remaining;
+    // the smallest pair not merged yet
+    IntermediatePair head;
+};
+
+/**
+ * The merge of a job that spilled. Reduce slots pull groups from it under its mutex, so only the
+ * heads of the runs are held in memory.
+ */
+struct StreamingMerge {
+    pthread_mutex_t mutex;
+    std::vector<MergeSource> sources;
+    // indices of the sources with pairs left, the smallest head on top
+    std::vector<size_t> heap;
+    std::vector<char> record;
+};
+
+/**
+ * Orders the sources in the heap of the streaming merge so the source with the smallest head is on top.
+ */
+struct SourceHasLargerHead {
+    explicit SourceHasLargerHead(const StreamingMerge *merge) : merge(merge) {}
+
+    bool operator()(size_t a, size_t b) const {
+        return *merge->sources[b].head.first < *merge->sources[a].head.first;
+    }
+
+    const StreamingMerge *merge;
+};
+
+/**
+ * A reduce group split into parts that threads reduce on their own. The partial results are merged up a
+ * binary tree laid out like a heap: the parts are the leaves leafCount + i, and the second child to finish
+ * merges the partial results of both children into their parent. The root emits the result of the group.
+ */
+struct SplitGroup {
+    IntermediateVec *group;
+    int partCount;
+    int leafCount;
+    std::vector<OutputVec> partials;
+    // children that finished, per inner node
+    std::vector<std::atomic<int>> arrivals;
+};
+
+/**
+ * A part of a split group, pairs [begin, end) of the group.
+ */
+struct GroupPart {
+    SplitGroup *splitGroup;
+    int leaf;
+    size_t begin;
+    size_t end;
+};
+
+/**
+ * Output pairs a JobGraph stage published to all the stages that consume it. Every consumer maps the split
+ * once, and the last one to finish it releases the pairs and frees the split.
+ */
+struct SharedSplit {
+    OutputVec pairs;
+    std::atomic<int> readers;
+};
+
+/**
+ * The pairs the producers of a JobGraph stage hand to its map. Producers fill a split per thread without a
+ * lock and publish full splits under the mutex, consumer slots that find no split park until a producer
+ * publishes one or the last producer closes the channel.
+ */
+struct StageChannel {
+    pthread_mutex_t mutex;
+    std::deque<SharedSplit *> readySplits;
+    std::vector<ThreadContext *> parkedSlots;
+    // producers that did not close the channel yet
+    int openProducers;
+    // pairs per split the consumer asks for
+    unsigned long splitPairs;
+    JobGraph::Handoff handoff;
+    JobGraph::Release release;
+    // the job of the consuming stage, its map total grows with every published split
+    JobContext *consumer;
 };
 
 /**
  *  job information
  */
 struct JobContext {
-    std::vector<std::vector<IntermediatePair>> shuffleArray;
+    // reduce-ready groups, one vector of groups per key range
+    std::vector<std::vector<IntermediateVec>> shufflePartitions;
+    // index of the first group of every partition when all partitions are counted in order
+    std::vector<unsigned long> partitionOffsets;
+    // the reduce items in claim order when some groups are split, an item below the group count is a
+    // whole group and any other item is the part item - group count
+    std::vector<unsigned long> reduceItems;
+    std::deque<SplitGroup> splitGroups;
+    std::vector<GroupPart> groupParts;
+    unsigned long largestGroupPairs;
+    // stage, processed and total counts packed in one word, kept on its own allocation so that
+    // progress updates do not invalidate the cache line of the read-mostly job fields
     std::atomic<uint64_t> *counterAtomic;
     int multiThreadLevel;
-    int waitFlag;
-    unsigned long maxSize;
+    // set under waitMutex once the last slot finished
+    bool finished;
+    std::atomic<unsigned long> shufflePairCount;
     const InputVec *inputVec;
+    // set instead of inputVec for jobs that pull their input
+    InputSource *inputSource;
+    // splitProgress of the input source is shifted right by this to fit the progress word
+    unsigned int sourceProgressShift;
+    // set instead of inputVec for JobGraph stages that map the output of other stages
+    StageChannel *inputChannel;
     const MapReduceClient *mapReduceClient;
+    // hasCombiner of the client, asked once per job so map skips the combine bookkeeping without one
+    bool hasCombiner;
     Barrier *barrier;
     ThreadContext *threadContexts;
-    JobState jobState;
     OutputVec *outputVec;
-    pthread_t *threadHandles;
-    pthread_mutex_t barrierMutex;
-    pthread_mutex_t vectorMutex;
-    pthread_mutex_t counterMutex;
-    pthread_mutex_t stageMutex;
+    JobOptions options;
+    std::atomic<int> finishedThreads;
     pthread_mutex_t waitMutex;
     pthread_cond_t conditionVar;
+    // slots waiting for a worker and the base of the virtual time of the job, guarded by the pool mutex
+    std::deque<ThreadContext *> runnableSlots;
+    double virtualTimeBase;
+    // the number of runnableSlots, and the worker time the job used, readable without the pool mutex
+    std::atomic<int> queuedSlots;
+    std::atomic<uint64_t> runNanos;
+    // pairs a slot holds before it spills, 0 when the job never spills
+    unsigned long slotPairBudget;
+    std::atomic<bool> spilled;
+    // set at the end of map when the job spilled, reduce then pulls groups from it
+    StreamingMerge *merge;
+    // pipelined jobs: slots that did not finish mapping, and per level l a finished slot whose sorted run,
+    // merged from 2^l runs, waits to be merged by the next slot to finish with a run of the same level
+    std::atomic<int> mappingSlots;
+    std::vector<ThreadContext *> pendingRuns;
+    pthread_mutex_t pipelineMutex;
+    // the time trace events are relative to, for jobs with a trace path
+    uint64_t traceOrigin;
+    // set for jobs of startPhasedJob, the slots run the phases instead of map, shuffle and reduce
+    JobPhases *phases;
 };
 
 /**
- *  thread information
+ *  information of one job slot, run by one pool worker at a time
  */
 struct ThreadContext {
     JobContext *jobContext;
+    int threadId;
+    slot_phase_t phase;
+    // when the current worker started running the slot
+    uint64_t sliceStart;
     IntermediateVec intermediateVec;
+    // pairs scattered by key hash, one vector per reducing thread, used by the hash shuffle only
+    std::vector<IntermediateVec> hashPartitions;
+    // set once the first key the thread emitted with the hash shuffle was found to be a HashedK2
+    bool hashedKeysChecked;
+    std::vector<K2 *> samples;
+    OutputVec outputVec;
+    TaskDeque tasks;
+    // pairs held by the thread and the count at which the combiner runs during map
+    unsigned long storedPairs;
+    unsigned long combineThreshold;
+    bool combining;
+    // written by the thread only, read by getJobStats
+    std::atomic<unsigned long> emittedPairs;
+    std::atomic<unsigned long> combinerInputPairs;
+    std::atomic<unsigned long> combinerOutputPairs;
+    std::atomic<unsigned long> arenaAllocations;
+    std::atomic<unsigned long> arenaBytes;
+    std::atomic<unsigned long> arenaBlockBytes;
+    std::atomic<unsigned long> spilledPairs;
+    std::atomic<unsigned long> spillRunCount;
+    std::atomic<unsigned long> spillMergeCount;
+    std::atomic<unsigned long> partialMerges;
+    std::atomic<unsigned long> reducedGroups;
+    // the phase of the current slice and the CPU clock of its worker when it started
+    slot_phase_t slicePhase;
+    uint64_t sliceCpuStart;
+    // when the slot reached the job barrier, 0 when it is not parked there
+    uint64_t barrierArrival;
+    // written by the running slot only, read by getJobStats
+    std::atomic<unsigned long> phaseWallNanos[REDUCE_PHASE + 1];
+    std::atomic<unsigned long> phaseCpuNanos[REDUCE_PHASE + 1];
+    std::atomic<unsigned long> sortNanos;
+    std::atomic<unsigned long> barrierWaitNanos;
+    std::atomic<unsigned long> lockWaitNanos;
+    // a ring of JobOptions::traceEvents events written by the running slot only, nullptr when the job
+    // does not trace, and the number of events recorded so far
+    TraceEvent *traceEvents;
+    unsigned long traceCount;
+    // set while reducing a part of a split group, emit3 collects the partial result there
+    OutputVec *partialOutput;
+    Arena arena;
+    std::vector<SpillRun> spillRuns;
+    // the input split being mapped, for jobs with an InputSource
+    InputVec inputSplit;
+    // keeps the vector of the next thread off this cache line, emit2 writes it without a lock
+    char cacheLinePadding[64];
 };
 
 
-Barrier::Barrier(int numThreads)
-        : mutex(PTHREAD_MUTEX_INITIALIZER), cv(PTHREAD_COND_INITIALIZER), count(0), numThreads(numThreads) {}
+Barrier::Barrier(int numThreads) : count(0), numThreads(numThreads) {}
 
-Barrier::~Barrier() {
-    if (pthread_mutex_destroy(&mutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex_destroy.\n");
-        exit(1);
-    }
-    if (pthread_cond_destroy(&cv) != 0) {
-        fprintf(stdout, "system error: on pthread_cond_destroy.\n");
-        exit(1);
+
+/**
+ * Counts the arrival of a slot. The last slot to arrive runs lastArrival, the writes of all the
+ * slots of the phase are visible to it. The barrier is ready for the next phase on return.
+ * @param jobContext - the job the slots belong to.
+ * @param lastArrival - function run once by the last slot to arrive.
+ * @return true for the last slot, which must then make the slots of the job runnable again.
+ */
+bool Barrier::arrive(JobContext *jobContext, void (*lastArrival)(JobContext *)) {
+    if (count.fetch_add(1, std::memory_order_acq_rel) + 1 < numThreads) {
+        return false;
     }
+    count.store(0, std::memory_order_relaxed);
+    lastArrival(jobContext);
+    return true;
 }
 
 
-void Barrier::barrier(JobContext *jobContext) {
-    if (pthread_mutex_lock(&mutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex_lock.\n");
-        exit(1);
-    }
-    if (++count < numThreads) {
-        if (pthread_cond_wait(&cv, &mutex) != 0) {
-            fprintf(stdout, "system error: on pthread_cond_wait.\n");
-            exit(1);
-        }
-    } else {
-        count = 0;
-        executeShuffleOperation(jobContext);
-        InitReduceStage(jobContext);
+/**
+ * The worker threads shared by all jobs. A job queues its slots and any worker runs them, so starting
+ * a job creates no threads. Jobs share the workers by weight: a worker always takes a slot of the
+ * active job with the smallest virtual time, the worker time the job used divided by its weight.
+ */
+struct WorkerPool {
+    pthread_mutex_t mutex;
+    pthread_cond_t slotReady;
+    // broadcast when a shutdown finished, jobs started meanwhile wait for it
+    pthread_cond_t stopped;
+    // jobs with at least one slot waiting for a worker
+    std::vector<JobContext *> activeJobs;
+    std::vector<pthread_t> workers;
+    // the largest virtual time a job was picked at, jobs that become active start no earlier
+    double virtualClock;
+    // slots waiting in all jobs, read without the mutex to decide whether a slot should yield
+    std::atomic<int> runnableSlotCount;
+    // set by initWorkerPool, otherwise the pool grows to the largest multiThreadLevel requested
+    bool fixedSize;
+    bool stopping;
+};
 
-        if (pthread_cond_broadcast(&cv) != 0) {
-            fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
-            exit(1);
-        }
-    }
-    if (pthread_mutex_unlock(&mutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex_unlock.\n");
-        exit(1);
-    }
-}
+static WorkerPool workerPool = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                                 {}, {}, 0, {0}, false, false};
 
+uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
 
 /**
- * Inserts a key-value pair into the intermediate array of the calling thread.
- * The operation is protected by a mutex to ensure thread safety.
- * @param key - the key part of the intermediate pair.
- * @param value - the value part of the intermediate pair.
- * @param context - the context structure of the calling thread, which contains the intermediate array.
+ * The CPU time the calling thread used.
  */
-void emit2(K2 *key, V2 *value, void *context) {
-    auto *threadContext = static_cast<ThreadContext *>(context);
-    IntermediatePair intermediatePair = std::make_pair(key, value);
-    if (pthread_mutex_lock(&threadContext->jobContext->vectorMutex) != 0) {
-        fprintf(stdout, "system error: emit2 failed to lock vectorMutex before adding pair.\n");
-        exit(EXIT_FAILURE);
-    }
-    threadContext->intermediateVec.push_back(intermediatePair);
-    if (pthread_mutex_unlock(&threadContext->jobContext->vectorMutex) != 0) {
-        fprintf(stdout, "system error: emit2 failed to unlock vectorMutex after adding pair.\n");
-        exit(EXIT_FAILURE);
-    }
+uint64_t threadCpuNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
 }
 
+// the slot the calling pool worker runs, nullptr outside runSlot
+static thread_local ThreadContext *runningSlot = nullptr;
 
 /**
- * Adds a key-value pair to the output array of the thread that calls this function.
- * The operation is performed within a mutex lock to ensure thread safety.
- * @param key - the key component of the output pair.
- * @param value - the value component of the output pair.
- * @param context - the context of the calling thread, which includes the output array.
+ * Locks a framework mutex like pthread_mutex_lock. Only a mutex that is already taken is timed, then the
+ * time blocked is added to the lock wait of the running slot, so an uncontended lock costs one trylock.
+ * @param mutex - the mutex to lock.
+ * @return the result of pthread_mutex_lock.
  */
-void emit3(K3 *key, V3 *value, void *context) {
-    auto *threadContext = static_cast<ThreadContext *>(context);
-    OutputPair newOutputPair = std::make_pair(key, value);
-    if (pthread_mutex_lock(&threadContext->jobContext->vectorMutex) != 0) {
-        fprintf(stderr, "system error: emit3 failed to lock vectorMutex before adding output pair.\n");
-        exit(EXIT_FAILURE);
+int lockCounted(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return 0;
     }
-    threadContext->jobContext->outputVec->push_back(newOutputPair);
-    if (pthread_mutex_unlock(&threadContext->jobContext->vectorMutex) != 0) {
-        fprintf(stderr, "system error: emit3 failed to unlock vectorMutex after adding output pair.\n");
+    uint64_t start = nowNanos();
+    int result = pthread_mutex_lock(mutex);
+    if (runningSlot != nullptr) {
+        addToCounter(runningSlot->lockWaitNanos, nowNanos() - start);
+    }
+    return result;
+}
+
+void lockWorkerPool() {
+    if (lockCounted(&workerPool.mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock worker pool mutex.\n");
         exit(EXIT_FAILURE);
     }
 }
 
+void unlockWorkerPool() {
+    if (pthread_mutex_unlock(&workerPool.mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock worker pool mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
 /**
- * Starts a new map-reduce job with the specified parameters.
- * @param client - the client object that contains the map and reduce functions.
- * @param inputVec - the vector that holds the input key-value pairs.
- * @param outputVec - the vector that will hold the output key-value pairs.
- * @param multiThreadLevel - the number of threads to use for the job
- * @return - a JobHandle that represents the job and its state.
+ * Waits until a running shutdown of the pool finished, called with the pool mutex held. A pool worker
+ * cannot wait, the shutdown joins it, so starting a job or shutting down from map or reduce while the
+ * pool shuts down is an error.
  */
-JobHandle startMapReduceJob(const MapReduceClient &client,
-                            const InputVec &inputVec, OutputVec &outputVec,
-                            int multiThreadLevel) {
-    // Allocate resources for job context
-    auto *barrier = new Barrier(multiThreadLevel);
-    auto *threads = new pthread_t[multiThreadLevel];
-    auto *atomicCounter = new std::atomic<uint64_t>(0);
-    auto *threadContexts = new ThreadContext[multiThreadLevel];
-    auto *jobContext = new JobContext;
-
-    // Initialize thread contexts
-    for (int i = 0; i < multiThreadLevel; ++i) {
-        threadContexts[i] = {jobContext};
-    }
-
-    // Set job context fields
-    jobContext->threadContexts = threadContexts;
-    jobContext->multiThreadLevel = multiThreadLevel;
-    jobContext->barrier = barrier;
-    jobContext->counterAtomic = atomicCounter;
-    jobContext->inputVec = &inputVec;
-    jobContext->outputVec = &outputVec;
-    jobContext->mapReduceClient = &client;
-    jobContext->threadHandles = threads;
-    jobContext->waitFlag = 0;
-    jobContext->conditionVar = PTHREAD_COND_INITIALIZER;
-    jobContext->barrierMutex = PTHREAD_MUTEX_INITIALIZER;
-    jobContext->vectorMutex = PTHREAD_MUTEX_INITIALIZER;
-    jobContext->stageMutex = PTHREAD_MUTEX_INITIALIZER;
-    jobContext->waitMutex = PTHREAD_MUTEX_INITIALIZER;
-    jobContext->counterMutex = PTHREAD_MUTEX_INITIALIZER;
-    jobContext->maxSize = inputVec.size();
-    jobContext->jobState = {UNDEFINED_STAGE, 0};
-
-    // Create threads
-    for (int i = 0; i < multiThreadLevel; ++i) {
-        if (pthread_create(&threads[i], nullptr, threadRun, &threadContexts[i]) != 0){
-            fprintf(stdout, "system error: Unable to create a new thread.\n");
+void waitWhileStopping() {
+    while (workerPool.stopping) {
+        if (runningSlot != nullptr) {
+            fprintf(stdout, "system error: the worker pool is shutting down.\n");
             exit(EXIT_FAILURE);
         }
-    }
-
-    return jobContext;
-}
-
-
-void executeMapping(ThreadContext *threadContext) {
-    threadContext->jobContext->jobState.stage = MAP_STAGE;
-    unsigned long inputIndex;
-    unsigned long inputSize = threadContext->jobContext->inputVec->size();
-    while (true) {
-        inputIndex = getInputPairIndex(threadContext);
-        if (inputIndex >= inputSize) {
-            break;
+        if (pthread_cond_wait(&workerPool.stopped, &workerPool.mutex) != 0) {
+            fprintf(stdout, "system error: on pthread_cond_wait.\n");
+            exit(EXIT_FAILURE);
         }
-        processInputPair(threadContext, inputIndex);
     }
 }
 
-void executeReduce(ThreadContext *threadContext) {
-    unsigned long OutputPairIndex = 0;
-    while (OutputPairIndex < threadContext->jobContext->shuffleArray.size()) {
-        OutputPairIndex = getInputPairIndex(threadContext);
-        if (OutputPairIndex >= threadContext->jobContext->shuffleArray.size()) {
-            break;
+/**
+ * Starts more workers, called with the pool mutex held.
+ * @param workerCount - the number of workers to add.
+ */
+void addWorkers(int workerCount) {
+    for (int i = 0; i < workerCount; ++i) {
+        pthread_t worker;
+        if (pthread_create(&worker, nullptr, workerRun, nullptr) != 0) {
+            fprintf(stdout, "system error: Unable to create a new thread.\n");
+            exit(EXIT_FAILURE);
         }
-        std::vector<std::vector<IntermediatePair>> cur_vec = threadContext->jobContext->shuffleArray;
-        const IntermediateVec cur_pairs_vec = threadContext->jobContext->shuffleArray.at(OutputPairIndex);
-        reducePair(threadContext, cur_pairs_vec);
+        workerPool.workers.push_back(worker);
     }
 }
 
 /**
- * The main function that runs the map-reduce job on a thread.
- * @param _arg - Pointer to the ThreadContext structure associated with the thread.
+ * Starts the shared worker pool with a fixed number of workers. A running pool is shut down first.
+ * @param workerCount - the number of workers, at least 1.
  */
-void *threadRun(void *_arg) {
-    auto *threadContext = (ThreadContext *) _arg;
-
-    executeMapping(threadContext);
-
-    sortIntermediatePairsByKeys(threadContext);
-
-    threadContext->jobContext->barrier->barrier(threadContext->jobContext);
-
-    executeReduce(threadContext);
-    return nullptr;
+void initWorkerPool(int workerCount) {
+    shutdownWorkerPool();
+    lockWorkerPool();
+    workerPool.fixedSize = true;
+    addWorkers(std::max(workerCount, 1));
+    unlockWorkerPool();
 }
 
 /**
- * Retrieves the next available index and increments the atomic counter.
- * @param threadContext - Pointer to the ThreadContext structure associated with the thread.
- * @return The next available index for the thread to process.
+ * Stops the shared worker pool. Workers leave once no slot is runnable, so jobs already started
+ * still run to completion. Jobs started meanwhile wait for the shutdown and start a new pool, like
+ * the next job does.
  */
-unsigned long getInputPairIndex(ThreadContext *threadContext) {
-    unsigned long mask = (1 << 31) - 1;
-    unsigned long curValue = (threadContext->jobContext->counterAtomic->fetch_add(1,
-                                                                                  std::memory_order_relaxed));
-    unsigned long nextValueIndex = curValue & mask;
-    return nextValueIndex;
-}
-
-
-void atomicCounterHandler(ThreadContext *threadContext) {
-    if (pthread_mutex_lock(&threadContext->jobContext->counterMutex) != 0) {
-        fprintf(stdout, "system error: Unable to lock counterMutex .\n");
+void shutdownWorkerPool() {
+    lockWorkerPool();
+    waitWhileStopping();
+    std::vector<pthread_t> workers;
+    workers.swap(workerPool.workers);
+    workerPool.stopping = true;
+    if (pthread_cond_broadcast(&workerPool.slotReady) != 0) {
+        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
         exit(EXIT_FAILURE);
     }
-
-    unsigned long incrementValue = 0x80000000;
-    threadContext->jobContext->counterAtomic->fetch_add(incrementValue, std::memory_order_relaxed);
-
-    unsigned long counterValue = threadContext->jobContext->counterAtomic->load(std::memory_order_relaxed);
-    unsigned long processedPairs = (counterValue >> 31) & 0x7fffffff;
-
-    float completionRate =
-            (static_cast<float>(processedPairs) / static_cast<float>(threadContext->jobContext->maxSize)) *
-            100.0f;
-    threadContext->jobContext->jobState.percentage = completionRate;
-
-    if (pthread_mutex_unlock(&threadContext->jobContext->counterMutex) != 0) {
-        fprintf(stdout, "system error: Unable to unlock counterMutex.\n");
+    unlockWorkerPool();
+    for (pthread_t worker : workers) {
+        if (pthread_join(worker, nullptr) != 0) {
+            fprintf(stdout, "system error: on pthread_join.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lockWorkerPool();
+    workerPool.stopping = false;
+    workerPool.fixedSize = false;
+    if (pthread_cond_broadcast(&workerPool.stopped) != 0) {
+        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
         exit(EXIT_FAILURE);
     }
-
+    unlockWorkerPool();
 }
 
 /**
- * Processes the next pair of key-value inputs and sends them to the map function.
- * @param threadContext
- * @param i - The index of the pair to process.
+ * The virtual time of a job, the order in which jobs get workers.
  */
-void processInputPair(ThreadContext *threadContext, unsigned long i) {
-    (*(threadContext->jobContext->mapReduceClient)).map((threadContext->jobContext->inputVec)->at(i).first,
-                                                        (threadContext->jobContext->inputVec)->at(i).second,
-                                                        threadContext);
-    atomicCounterHandler(threadContext);
+double virtualTime(JobContext *jobContext) {
+    return jobContext->virtualTimeBase
+           + static_cast<double>(jobContext->runNanos.load(std::memory_order_relaxed)) / jobContext->options.weight;
 }
 
 /**
- * Reduces the current pair of key-value inputs and sends them to the reduce function.
- * @param threadContext - The context of the thread that is processing the pair.
- * @param curPair - The current pair of key-value inputs to reduce.
+ * Queues a slot of its job, called with the pool mutex held. A job that had no slot waiting is moved
+ * up to the virtual clock, so the time it spent without runnable slots is not a credit over the jobs
+ * that kept running.
+ * @param threadContext - the slot to queue.
  */
-void reducePair(ThreadContext *threadContext, const IntermediateVec curPair) {
-    (*(threadContext->jobContext->mapReduceClient)).reduce(&curPair, threadContext);
-    atomicCounterHandler(threadContext);
+void queueSlot(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    if (jobContext->runnableSlots.empty()) {
+        double lag = workerPool.virtualClock - virtualTime(jobContext);
+        if (lag > 0) {
+            jobContext->virtualTimeBase += lag;
+        }
+        workerPool.activeJobs.push_back(jobContext);
+    }
+    jobContext->runnableSlots.push_back(threadContext);
+    jobContext->queuedSlots.fetch_add(1, std::memory_order_relaxed);
+    workerPool.runnableSlotCount.fetch_add(1, std::memory_order_relaxed);
 }
 
-void InitReduceStage(JobContext *jobContext) {
-    jobContext->maxSize = jobContext->shuffleArray.size();
-    jobContext->counterAtomic->store(0);
-    jobContext->counterAtomic->fetch_add(0x8000000000000000);
-    jobContext->counterAtomic->fetch_add(0x4000000000000000);
-    jobContext->jobState = {REDUCE_STAGE, 0.0f};
+/**
+ * Takes the next slot of the active job with the smallest virtual time, called with the pool mutex
+ * held and at least one active job.
+ * @return the slot to run.
+ */
+ThreadContext *takeSlot() {
+    std::vector<JobContext *> &jobs = workerPool.activeJobs;
+    size_t chosen = 0;
+    double chosenTime = virtualTime(jobs[0]);
+    for (size_t i = 1; i < jobs.size(); ++i) {
+        double time = virtualTime(jobs[i]);
+        if (time < chosenTime) {
+            chosen = i;
+            chosenTime = time;
+        }
+    }
+    JobContext *jobContext = jobs[chosen];
+    ThreadContext *threadContext = jobContext->runnableSlots.front();
+    jobContext->runnableSlots.pop_front();
+    jobContext->queuedSlots.fetch_sub(1, std::memory_order_relaxed);
+    workerPool.runnableSlotCount.fetch_sub(1, std::memory_order_relaxed);
+    if (jobContext->runnableSlots.empty()) {
+        jobs[chosen] = jobs.back();
+        jobs.pop_back();
+    }
+    workerPool.virtualClock = std::max(workerPool.virtualClock, chosenTime);
+    return threadContext;
 }
 
-
 /**
- *  Configures the environment for the shuffle stage of the job.
- * @param jobDetails - The JobContext structure
+ * Queues every slot of the job and wakes the workers, called with the pool mutex held.
+ * @param jobContext - the job whose slots become runnable.
  */
-void configureShuffleEnvironment(JobContext *jobDetails) {
-    if (pthread_mutex_lock(&jobDetails->stageMutex) != 0) {
-        fprintf(stdout, "system error: Failed to lock stage mutex at shuffle initialization.\n");
+void queueJobSlots(JobContext *jobContext) {
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        queueSlot(&jobContext->threadContexts[i]);
+    }
+    if (pthread_cond_broadcast(&workerPool.slotReady) != 0) {
+        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
         exit(EXIT_FAILURE);
     }
+}
 
-    // Initialize the counter and set the upper bit to mark start of shuffle
-    jobDetails->counterAtomic->store(0x8000000000000000);
-
-    // Update the job state to indicate the shuffle stage has begun
-    jobDetails->jobState.stage = SHUFFLE_STAGE;
-    jobDetails->jobState.percentage = 0;
+/**
+ * Makes every slot of the job runnable, after the last slot arrived at the job barrier.
+ * @param jobContext - the job whose slots become runnable.
+ */
+void scheduleSlots(JobContext *jobContext) {
+    lockWorkerPool();
+    queueJobSlots(jobContext);
+    unlockWorkerPool();
+}
 
-    // Compute the total number of key-value pairs across all threads
-    unsigned long pairCount = 0;
-    for (int idx = 0; idx < jobDetails->multiThreadLevel; idx++) {
-        pairCount += (jobDetails->threadContexts + idx)->intermediateVec.size();
+/**
+ * Makes parked slots runnable again, slots of JobGraph stages that waited for input.
+ * @param slots - the slots to queue, may be empty.
+ */
+void wakeSlots(const std::vector<ThreadContext *> &slots) {
+    if (slots.empty()) {
+        return;
     }
-    jobDetails->maxSize = pairCount;
-
-    // Adjust the counter to include the pair count at a specific bit position
-    jobDetails->counterAtomic->fetch_add(pairCount << 31);
-
-    if (pthread_mutex_unlock(&jobDetails->stageMutex) != 0) {
-        fprintf(stdout, "system error: Failed to unlock stage mutex after shuffle setup.\n");
+    lockWorkerPool();
+    for (ThreadContext *threadContext : slots) {
+        queueSlot(threadContext);
+    }
+    if (pthread_cond_broadcast(&workerPool.slotReady) != 0) {
+        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
         exit(EXIT_FAILURE);
     }
+    unlockWorkerPool();
 }
 
-
 /**
- * Helper function to find the largest key in the current intermediate vectors.
- * This version uses a direct reference to keep track of the largest pair, simplifying the logic.
- * @param jobContext - Contains all thread contexts and their vectors.
- * @return The largest intermediate pair found across all threads.
+ * Starts the slice of a slot a worker took. A slot coming back from the job barrier adds the time
+ * it was parked there to its barrier wait.
+ * @param threadContext - the slot the worker runs.
  */
-IntermediatePair findLargestKey(JobContext *jobContext) {
-    IntermediatePair *largestPair = nullptr;
-
-    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
-        IntermediateVec &vec = (jobContext->threadContexts + i)->intermediateVec;
-        if (!vec.empty() && (!largestPair || *largestPair->first < *vec.back().first)) {
-            largestPair = &vec.back();
+void startSlice(ThreadContext *threadContext) {
+    threadContext->sliceStart = nowNanos();
+    threadContext->sliceCpuStart = threadCpuNanos();
+    threadContext->slicePhase = threadContext->phase;
+    if (threadContext->barrierArrival != 0) {
+        addToCounter(threadContext->barrierWaitNanos, threadContext->sliceStart - threadContext->barrierArrival);
+        if (threadContext->traceEvents != nullptr) {
+            traceEnd(threadContext, "barrier wait", threadContext->barrierArrival, 0);
         }
+        threadContext->barrierArrival = 0;
     }
-
-    return largestPair ? *largestPair : IntermediatePair(nullptr,
-                                                         nullptr); // Return an empty pair if none found
 }
 
 /**
- * Collects all pairs with the same key as the provided largest pair.
- * This version uses iterators for clarity and better control over vector manipulation.
- * @param jobContext - Contains all thread contexts and their vectors.
- * @param largestPair - The key to match against.
- * @return A vector of all pairs matching the largest key.
+ * Adds the time the slot ran since its slice started to its job and to the times of its phase, before
+ * the slot yields, arrives or finishes. The slice goes on from now.
+ * @param threadContext - the running slot.
  */
-std::vector<IntermediatePair>
-collectPairsWithKey(JobContext *jobContext, const IntermediatePair &largestPair) {
-    std::vector<IntermediatePair> collectedPairs;
+void chargeSlot(ThreadContext *threadContext) {
+    uint64_t now = nowNanos();
+    uint64_t cpuNow = threadCpuNanos();
+    threadContext->jobContext->runNanos.fetch_add(now - threadContext->sliceStart, std::memory_order_relaxed);
+    addToCounter(threadContext->phaseWallNanos[threadContext->slicePhase], now - threadContext->sliceStart);
+    addToCounter(threadContext->phaseCpuNanos[threadContext->slicePhase], cpuNow - threadContext->sliceCpuStart);
+    if (threadContext->traceEvents != nullptr) {
+        static const char *const phaseNames[] = {"map", "shuffle", "reduce"};
+        traceEnd(threadContext, phaseNames[threadContext->slicePhase], threadContext->sliceStart, 0);
+    }
+    threadContext->sliceStart = now;
+    threadContext->sliceCpuStart = cpuNow;
+}
+
+/**
+ * Tells whether a running slot should give its worker away: it ran a full quantum and a slot of
+ * another job is waiting. Checked after every claimed range of map and reduce.
+ * @param threadContext - the running slot.
+ */
+bool sliceExpired(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    if (workerPool.runnableSlotCount.load(std::memory_order_relaxed)
+        <= jobContext->queuedSlots.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    return nowNanos() - threadContext->sliceStart >= SLOT_QUANTUM_NS;
+}
+
+/**
+ * Queues a slot that stopped in the middle of its phase, it resumes where it stopped.
+ * @param threadContext - the slot that yields its worker.
+ */
+void yieldSlot(ThreadContext *threadContext) {
+    chargeSlot(threadContext);
+    lockWorkerPool();
+    queueSlot(threadContext);
+    unlockWorkerPool();
+}
+
+/**
+ * The main function of a pool worker, runs runnable slots of any job until the pool stops.
+ */
+void *workerRun(void *_arg) {
+    (void) _arg;
+    while (true) {
+        lockWorkerPool();
+        while (workerPool.activeJobs.empty() && !workerPool.stopping) {
+            if (pthread_cond_wait(&workerPool.slotReady, &workerPool.mutex) != 0) {
+                fprintf(stdout, "system error: on pthread_cond_wait.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (workerPool.activeJobs.empty()) {
+            unlockWorkerPool();
+            return nullptr;
+        }
+        ThreadContext *threadContext = takeSlot();
+        unlockWorkerPool();
+        startSlice(threadContext);
+        runningSlot = threadContext;
+        runSlot(threadContext);
+        runningSlot = nullptr;
+    }
+}
+
+
+/**
+ * Hash and equality of intermediate keys, forwarded to the client key. Only used by the hash shuffle, whose
+ * keys emit2 checked to be HashedK2.
+ */
+struct KeyHash {
+    size_t operator()(const K2 *key) const {
+        return static_cast<const HashedK2 *>(key)->hash();
+    }
+};
+
+struct KeyEqual {
+    bool operator()(const K2 *a, const K2 *b) const {
+        return *static_cast<const HashedK2 *>(a) == *b;
+    }
+};
+
+/**
+ * Spreads the bits of a client key hash, so the partition index and the buckets of the
+ * hash tables that group the partition do not use the same bits.
+ */
+size_t mixHash(size_t hash) {
+    uint64_t mixed = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(mixed ^ (mixed >> 32));
+}
+
+/**
+ * Adds to a statistics counter that only the calling slot writes.
+ */
+void addToCounter(std::atomic<unsigned long> &counter, unsigned long amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/**
+ * The start of a span for the trace of the job.
+ * @param threadContext - the running slot.
+ * @return the current time, or 0 when the job does not trace.
+ */
+uint64_t traceBegin(ThreadContext *threadContext) {
+    return threadContext->traceEvents == nullptr ? 0 : nowNanos();
+}
+
+/**
+ * Records a span that ends now in the trace ring of the slot, over its oldest event once the ring is
+ * full. Only the running slot writes its ring, so no synchronization is needed.
+ * @param threadContext - the running slot.
+ * @param name - the name of the span, a string literal.
+ * @param start - the start of the span, from traceBegin.
+ * @param items - the pairs or groups the span processed, or 0.
+ */
+void traceEnd(ThreadContext *threadContext, const char *name, uint64_t start, unsigned long items) {
+    if (threadContext->traceEvents == nullptr) {
+        return;
+    }
+    TraceEvent &event = threadContext->traceEvents[threadContext->traceCount
+                                                   % threadContext->jobContext->options.traceEvents];
+    event.name = name;
+    event.start = start;
+    event.end = nowNanos();
+    event.items = items;
+    ++threadContext->traceCount;
+}
+
+/**
+ * Allocates memory for an intermediate key or value from the arena of the calling slot. The slot owns its
+ * arena, so no lock is taken; the memory lives until the last group of the job was reduced.
+ * @param size - the number of bytes.
+ * @param context - the context structure of the calling thread, as passed to map and combine.
+ * @return memory aligned to ARENA_ALIGNMENT.
+ */
+void *allocateIntermediate(size_t size, void *context) {
+    auto *threadContext = static_cast<ThreadContext *>(context);
+    Arena &arena = threadContext->arena;
+    size = (size + ARENA_ALIGNMENT - 1) & ~static_cast<size_t>(ARENA_ALIGNMENT - 1);
+    addToCounter(threadContext->arenaAllocations, 1);
+    addToCounter(threadContext->arenaBytes, size);
+    if (static_cast<size_t>(arena.end - arena.next) >= size) {
+        char *memory = arena.next;
+        arena.next += size;
+        return memory;
+    }
+
+    // a large allocation gets its own block and the current block stays in use
+    size_t blockSize = size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE;
+    auto *block = static_cast<char *>(malloc(blockSize));
+    if (block == nullptr) {
+        fprintf(stdout, "system error: Unable to allocate an arena block.\n");
+        exit(EXIT_FAILURE);
+    }
+    arena.blocks.push_back({block, blockSize});
+    addToCounter(threadContext->arenaBlockBytes, blockSize);
+    if (blockSize == ARENA_BLOCK_SIZE) {
+        arena.next = block + size;
+        arena.end = block + blockSize;
+    }
+    return block;
+}
+
+/**
+ * Frees the arena blocks of all the slots, called once by the last slot to finish reducing,
+ * when no group refers to arena memory anymore.
+ * @param jobContext - The context of the job containing all thread contexts.
+ */
+void releaseArenas(JobContext *jobContext) {
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        resetArena(jobContext->threadContexts[i].arena);
+    }
+}
+
+/**
+ * Frees every block of an arena, the next allocation starts a new block.
+ * @param arena - an arena no pair refers to anymore.
+ */
+void resetArena(Arena &arena) {
+    for (const ArenaBlock &block : arena.blocks) {
+        free(block.memory);
+    }
+    std::vector<ArenaBlock>().swap(arena.blocks);
+    arena.next = nullptr;
+    arena.end = nullptr;
+}
+
+/**
+ * Tells whether an object lives in one of the blocks of an arena.
+ * @param sortedBlocks - the blocks of the arena, sorted by address.
+ * @param object - a key or value.
+ */
+bool arenaHolds(const std::vector<ArenaBlock> &sortedBlocks, const void *object) {
+    auto address = reinterpret_cast<uintptr_t>(object);
+    // the block holding the object is the last one starting at or before it
+    auto block = std::upper_bound(sortedBlocks.begin(), sortedBlocks.end(), address,
+                                  [](uintptr_t objectAddress, const ArenaBlock &candidate) {
+                                      return objectAddress < reinterpret_cast<uintptr_t>(candidate.memory);
+                                  });
+    return block != sortedBlocks.begin()
+           && address < reinterpret_cast<uintptr_t>((block - 1)->memory) + (block - 1)->size;
+}
+
+/**
+ * Inserts a key-value pair into the intermediate array of the calling thread.
+ * The intermediate array is owned by the calling thread only, so no lock is needed.
+ * With the hash shuffle the pair goes straight to the partition of the thread that will group its key. The
+ * first key a thread emits is checked to be a HashedK2 there, a key without a hash of its own would leave
+ * every pair in one bucket.
+ * @param key - the key part of the intermediate pair.
+ * @param value - the value part of the intermediate pair.
+ * @param context - the context structure of the calling thread, which contains the intermediate array.
+ */
+void emit2(K2 *key, V2 *value, void *context) {
+    auto *threadContext = static_cast<ThreadContext *>(context);
+    std::atomic<unsigned long> &counter = threadContext->combining ? threadContext->combinerOutputPairs
+                                                                   : threadContext->emittedPairs;
+    addToCounter(counter, 1);
+    JobContext *jobContext = threadContext->jobContext;
+    if (jobContext->hasCombiner) {
+        ++threadContext->storedPairs;
+    }
+    if (jobContext->options.shuffleMode == HASH_SHUFFLE) {
+        if (!threadContext->hashedKeysChecked) {
+            if (dynamic_cast<const HashedK2 *>(key) == nullptr) {
+                fprintf(stdout, "system error: HASH_SHUFFLE needs intermediate keys derived from HashedK2.\n");
+                exit(EXIT_FAILURE);
+            }
+            threadContext->hashedKeysChecked = true;
+        }
+        size_t partition = mixHash(KeyHash()(key)) % threadContext->hashPartitions.size();
+        threadContext->hashPartitions[partition].push_back(std::make_pair(key, value));
+        return;
+    }
+    threadContext->intermediateVec.push_back(std::make_pair(key, value));
+}
+
+
+/**
+ * Adds a key-value pair to the output array of the thread that calls this function.
+ * The output array is owned by the calling thread and is spliced into the job output once at the end.
+ * Jobs with an output sink pass the pair straight to the sink instead.
+ * @param key - the key component of the output pair.
+ * @param value - the value component of the output pair.
+ * @param context - the context of the calling thread, which includes the output array.
+ */
+void emit3(K3 *key, V3 *value, void *context) {
+    auto *threadContext = static_cast<ThreadContext *>(context);
+    if (threadContext->partialOutput != nullptr) {
+        threadContext->partialOutput->push_back(std::make_pair(key, value));
+        return;
+    }
+    OutputSink *outputSink = threadContext->jobContext->options.outputSink;
+    if (outputSink != nullptr) {
+        outputSink->write(threadContext->threadId, key, value);
+        return;
+    }
+    threadContext->outputVec.push_back(std::make_pair(key, value));
+}
+
+
+/**
+ * Starts a new map-reduce job with the specified parameters.
+ * @param client - the client object that contains the map and reduce functions.
+ * @param inputVec - the vector that holds the input key-value pairs.
+ * @param outputVec - the vector that will hold the output key-value pairs.
+ * @param multiThreadLevel - the number of threads to use for the job
+ * @return - a JobHandle that represents the job and its state.
+ */
+JobHandle startMapReduceJob(const MapReduceClient &client,
+                            const InputVec &inputVec, OutputVec &outputVec,
+                            int multiThreadLevel) {
+    return startMapReduceJob(client, inputVec, outputVec, multiThreadLevel, JobOptions());
+}
+
+
+/**
+ * Starts a new map-reduce job with the specified parameters and options.
+ * @param client - the client object that contains the map and reduce functions.
+ * @param inputVec - the vector that holds the input key-value pairs.
+ * @param outputVec - the vector that will hold the output key-value pairs.
+ * @param multiThreadLevel - the number of slots the job is split into, the most pool workers it uses at once
+ * @param options - the job options, see JobOptions.
+ * @return - a JobHandle that represents the job and its state.
+ */
+JobHandle startMapReduceJob(const MapReduceClient &client,
+                            const InputVec &inputVec, OutputVec &outputVec,
+                            int multiThreadLevel, const JobOptions &options) {
+    JobContext *jobContext = newJobContext(&client, &inputVec, &outputVec, multiThreadLevel, options);
+    submitJob(jobContext);
+    return jobContext;
+}
+
+/**
+ * Starts a new map-reduce job that pulls its input from a source while it maps.
+ * @param client - the client object that contains the map and reduce functions.
+ * @param inputSource - the source of the input pairs, must outlive the job.
+ * @param outputVec - the vector that will hold the output key-value pairs.
+ * @param multiThreadLevel - the number of slots the job is split into, the most pool workers it uses at once
+ * @param options - the job options, see JobOptions.
+ * @return - a JobHandle that represents the job and its state.
+ */
+JobHandle startMapReduceJob(const MapReduceClient &client,
+                            InputSource &inputSource, OutputVec &outputVec,
+                            int multiThreadLevel, const JobOptions &options) {
+    JobContext *jobContext = newJobContext(&client, nullptr, &outputVec, multiThreadLevel, options);
+    jobContext->inputSource = &inputSource;
+    // a size above the progress word (e.g. the bytes of large files) is counted in units of 2^shift
+    unsigned long sizeHint = inputSource.sizeHint();
+    while ((sizeHint >> jobContext->sourceProgressShift) > INDEX_MASK) {
+        ++jobContext->sourceProgressShift;
+    }
+    sizeHint >>= jobContext->sourceProgressShift;
+    // with an unknown size the map stage reports 0 of 1 until it ends
+    jobContext->counterAtomic->store(packProgress(MAP_STAGE, 0, sizeHint == 0 ? 1 : sizeHint));
+    submitJob(jobContext);
+    return jobContext;
+}
+
+/**
+ * Starts a job whose slots run the given phases instead of map, shuffle and reduce, see JobPhases.
+ * The job keeps no pairs of its own, so of the options only the weight and the trace apply.
+ * @param phases - the phases, phases.destroy is called by closeJobHandle.
+ * @param inputSize - the number of items the map phase processes, for getJobState.
+ * @param multiThreadLevel - the number of slots of the job.
+ * @param options - the job options.
+ * @return the job handle.
+ */
+JobHandle startPhasedJob(const JobPhases &phases, unsigned long inputSize, int multiThreadLevel,
+                         const JobOptions &options) {
+    JobOptions phasedOptions;
+    phasedOptions.mergeOutput = false;
+    phasedOptions.weight = options.weight;
+    phasedOptions.tracePath = options.tracePath;
+    phasedOptions.traceEvents = options.traceEvents;
+    JobContext *jobContext = newJobContext(nullptr, nullptr, nullptr, std::max(multiThreadLevel, 1), phasedOptions);
+    jobContext->phases = new JobPhases(phases);
+    jobContext->counterAtomic->store(packProgress(MAP_STAGE, 0, std::min(inputSize, INDEX_MASK)));
+    submitJob(jobContext);
+    return jobContext;
+}
+
+/**
+ * Runs the shuffle of a phased job and moves it to the reduce stage, by the last slot to finish mapping.
+ * @param jobContext - the phased job.
+ */
+void shufflePhasedJob(JobContext *jobContext) {
+    uint64_t shuffleStart = traceBegin(runningSlot);
+    unsigned long reduceItems = jobContext->phases->shuffle(jobContext->phases->arg);
+    traceEnd(runningSlot, "phased shuffle", shuffleStart, reduceItems);
+    jobContext->counterAtomic->store(packProgress(REDUCE_STAGE, 0, std::min(reduceItems, INDEX_MASK)));
+}
+
+/**
+ * Counts items of the current stage of a phased job as processed.
+ * @param context - the context map or reduce of the phases got.
+ * @param items - the items processed since the last call.
+ */
+void addJobProgress(void *context, unsigned long items) {
+    reportProgress(static_cast<ThreadContext *>(context), items);
+}
+
+/**
+ * Tells map or reduce of a phased job to give the worker to another job.
+ * @param context - the context map or reduce of the phases got.
+ */
+bool jobShouldYield(void *context) {
+    return sliceExpired(static_cast<ThreadContext *>(context));
+}
+
+/**
+ * Allocates a job and its slots, the job does not run until submitJob.
+ * @param client - the client, nullptr for phased jobs.
+ * @param inputVec - the input pairs, nullptr for phased jobs.
+ * @param outputVec - the output vector, nullptr for phased jobs.
+ * @param multiThreadLevel - the number of slots of the job.
+ * @param options - the job options.
+ * @return the new job.
+ */
+JobContext *newJobContext(const MapReduceClient *client, const InputVec *inputVec, OutputVec *outputVec,
+                          int multiThreadLevel, const JobOptions &options) {
+    unsigned long inputSize = inputVec == nullptr ? 0 : inputVec->size();
+    // Allocate resources for job context
+    auto *barrier = new Barrier(multiThreadLevel);
+    auto *atomicCounter = new std::atomic<uint64_t>(packProgress(MAP_STAGE, 0, inputSize));
+    auto *threadContexts = new ThreadContext[multiThreadLevel];
+    auto *jobContext = new JobContext;
+
+    // Initialize thread contexts
+    for (int i = 0; i < multiThreadLevel; ++i) {
+        threadContexts[i].jobContext = jobContext;
+        threadContexts[i].threadId = i;
+        threadContexts[i].phase = MAP_PHASE;
+        threadContexts[i].storedPairs = 0;
+        threadContexts[i].combineThreshold = options.combineThreshold;
+        threadContexts[i].combining = false;
+        threadContexts[i].hashedKeysChecked = false;
+        threadContexts[i].emittedPairs = 0;
+        threadContexts[i].combinerInputPairs = 0;
+        threadContexts[i].combinerOutputPairs = 0;
+        threadContexts[i].arenaAllocations = 0;
+        threadContexts[i].arenaBytes = 0;
+        threadContexts[i].arenaBlockBytes = 0;
+        threadContexts[i].spilledPairs = 0;
+        threadContexts[i].spillRunCount = 0;
+        threadContexts[i].spillMergeCount = 0;
+        threadContexts[i].partialMerges = 0;
+        threadContexts[i].reducedGroups = 0;
+        threadContexts[i].barrierArrival = 0;
+        for (int phase = MAP_PHASE; phase <= REDUCE_PHASE; ++phase) {
+            threadContexts[i].phaseWallNanos[phase] = 0;
+            threadContexts[i].phaseCpuNanos[phase] = 0;
+        }
+        threadContexts[i].sortNanos = 0;
+        threadContexts[i].barrierWaitNanos = 0;
+        threadContexts[i].lockWaitNanos = 0;
+        threadContexts[i].traceEvents = nullptr;
+        threadContexts[i].traceCount = 0;
+        if (options.tracePath != nullptr && options.traceEvents != 0) {
+            threadContexts[i].traceEvents = new TraceEvent[options.traceEvents];
+        }
+        threadContexts[i].partialOutput = nullptr;
+        threadContexts[i].arena.next = nullptr;
+        threadContexts[i].arena.end = nullptr;
+        threadContexts[i].tasks.mutex = PTHREAD_MUTEX_INITIALIZER;
+        if (options.shuffleMode == HASH_SHUFFLE) {
+            threadContexts[i].hashPartitions.resize(multiThreadLevel);
+        }
+    }
+
+    // Set job context fields
+    jobContext->threadContexts = threadContexts;
+    jobContext->multiThreadLevel = multiThreadLevel;
+    jobContext->barrier = barrier;
+    jobContext->counterAtomic = atomicCounter;
+    jobContext->inputVec = inputVec;
+    jobContext->inputSource = nullptr;
+    jobContext->sourceProgressShift = 0;
+    jobContext->inputChannel = nullptr;
+    jobContext->outputVec = outputVec;
+    jobContext->options = options;
+    jobContext->finishedThreads = 0;
+    jobContext->mapReduceClient = client;
+    jobContext->hasCombiner = client != nullptr && client->hasCombiner();
+    jobContext->finished = false;
+    jobContext->options.weight = std::max(options.weight, 1u);
+    jobContext->virtualTimeBase = 0;
+    jobContext->queuedSlots = 0;
+    jobContext->runNanos = 0;
+    jobContext->conditionVar = PTHREAD_COND_INITIALIZER;
+    jobContext->waitMutex = PTHREAD_MUTEX_INITIALIZER;
+    jobContext->shufflePairCount = 0;
+    jobContext->phases = nullptr;
+    jobContext->traceOrigin = nowNanos();
+    jobContext->slotPairBudget = 0;
+    if (options.memoryBudget != 0 && options.serializer != nullptr && options.shuffleMode != HASH_SHUFFLE) {
+        jobContext->slotPairBudget = std::max(options.memoryBudget / multiThreadLevel, 1UL);
+    }
+    jobContext->spilled = false;
+    jobContext->merge = nullptr;
+    jobContext->mappingSlots = multiThreadLevel;
+    jobContext->largestGroupPairs = 0;
+    jobContext->pipelineMutex = PTHREAD_MUTEX_INITIALIZER;
+    if (options.outputSink != nullptr) {
+        options.outputSink->open(multiThreadLevel);
+    }
+    distributeTasks(jobContext, inputSize);
+    return jobContext;
+}
+
+/**
+ * Grows a pool that was not sized by initWorkerPool to the slots of the job, then queues the slots. The
+ * check for a running shutdown, the new workers and the queued slots are all done under one hold of the
+ * pool mutex, so no slot reaches a worker that is leaving.
+ * @param jobContext - the job to run.
+ */
+void submitJob(JobContext *jobContext) {
+    int multiThreadLevel = jobContext->multiThreadLevel;
+    lockWorkerPool();
+    waitWhileStopping();
+    if (!workerPool.fixedSize && static_cast<int>(workerPool.workers.size()) < multiThreadLevel) {
+        addWorkers(multiThreadLevel - static_cast<int>(workerPool.workers.size()));
+    }
+    queueJobSlots(jobContext);
+    unlockWorkerPool();
+}
+
+
+/**
+ * Maps input ranges until no input is left or the time slice of the slot expires.
+ * @param threadContext - the running slot.
+ * @return true once the slot finished mapping, false when it yields its worker.
+ */
+bool executeMapping(ThreadContext *threadContext) {
+    const InputVec *inputVec = threadContext->jobContext->inputVec;
+    if (threadContext->jobContext->inputSource != nullptr) {
+        if (!mapSourceSplits(threadContext)) {
+            return false;
+        }
+        combineIntermediatePairs(threadContext);
+        return true;
+    }
+    unsigned long begin, end;
+    while (claimRange(threadContext, &begin, &end)) {
+        uint64_t taskStart = traceBegin(threadContext);
+        for (unsigned long inputIndex = begin; inputIndex < end; ++inputIndex) {
+            processInputPair(threadContext, (*inputVec)[inputIndex].first, (*inputVec)[inputIndex].second);
+        }
+        traceEnd(threadContext, "map task", taskStart, end - begin);
+        reportProgress(threadContext, end - begin);
+        if (sliceExpired(threadContext)) {
+            return false;
+        }
+    }
+    combineIntermediatePairs(threadContext);
+    return true;
+}
+
+/**
+ * Pulls splits from the input source of the job and maps them until the source runs out or the time
+ * slice of the slot expires. A slot only yields between splits, so it holds at most one split.
+ * @param threadContext - the running slot.
+ * @return true once the source ran out, false when the slot yields its worker.
+ */
+bool mapSourceSplits(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    InputSource *inputSource = jobContext->inputSource;
+    unsigned long grain = jobContext->options.taskGrain == 0 ? SOURCE_SPLIT_PAIRS : jobContext->options.taskGrain;
+    bool reportsProgress = inputSource->sizeHint() != 0;
+    unsigned int progressShift = jobContext->sourceProgressShift;
+    InputVec &split = threadContext->inputSplit;
+    while (true) {
+        split.clear();
+        if (!inputSource->nextSplit(split, grain)) {
+            return true;
+        }
+        uint64_t taskStart = traceBegin(threadContext);
+        for (const InputPair &pair : split) {
+            processInputPair(threadContext, pair.first, pair.second);
+        }
+        // read before the split is handed back, the source may clear or recycle it
+        unsigned long mappedPairs = split.size();
+        unsigned long progress = reportsProgress ? inputSource->splitProgress(split) : 0;
+        traceEnd(threadContext, "map split", taskStart, mappedPairs);
+        inputSource->releaseSplit(split);
+        if (reportsProgress) {
+            reportProgress(threadContext, progress >> progressShift);
+        }
+        if (sliceExpired(threadContext)) {
+            return false;
+        }
+    }
+}
+
+/**
+ * Maps the splits the producers of a JobGraph stage publish until they all closed the channel and no
+ * split is left. A slot that finds no split parks on the channel instead of holding a worker, and the
+ * next producer to publish a split queues it again.
+ * @param threadContext - the running slot.
+ * @return true once the slot finished mapping, false when it yielded its worker or parked.
+ */
+bool mapChannelSplits(ThreadContext *threadContext) {
+    StageChannel *channel = threadContext->jobContext->inputChannel;
+    InputVec &split = threadContext->inputSplit;
+    while (true) {
+        lockChannel(channel);
+        if (channel->readySplits.empty()) {
+            if (channel->openProducers == 0) {
+                unlockChannel(channel);
+                combineIntermediatePairs(threadContext);
+                return true;
+            }
+            // charged while no producer can see the slot, a producer may queue it on another worker right away
+            chargeSlot(threadContext);
+            channel->parkedSlots.push_back(threadContext);
+            unlockChannel(channel);
+            return false;
+        }
+        SharedSplit *sharedSplit = channel->readySplits.front();
+        channel->readySplits.pop_front();
+        unlockChannel(channel);
+        uint64_t taskStart = traceBegin(threadContext);
+        for (const OutputPair &pair : sharedSplit->pairs) {
+            InputPair input(nullptr, nullptr);
+            channel->handoff(pair.first, pair.second, &input.first, &input.second);
+            split.push_back(input);
+        }
+        for (const InputPair &pair : split) {
+            processInputPair(threadContext, pair.first, pair.second);
+        }
+        traceEnd(threadContext, "map split", taskStart, split.size());
+        addChannelProgress(threadContext->jobContext, split.size(), 0);
+        // the other consumers of the producer may still map the pairs
+        if (sharedSplit->readers.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (channel->release != nullptr) {
+                for (const InputPair &pair : split) {
+                    channel->release(pair.first, pair.second);
+                }
+            }
+            delete sharedSplit;
+        }
+        split.clear();
+        if (sliceExpired(threadContext)) {
+            yieldSlot(threadContext);
+            return false;
+        }
+    }
+}
+
+/**
+ * Reduces group ranges until no group is left or the time slice of the slot expires.
+ * @param threadContext - the running slot.
+ * @return true once the slot finished reducing, false when it yields its worker.
+ */
+bool executeReduce(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    if (jobContext->merge != nullptr) {
+        std::vector<IntermediateVec> groups;
+        while (true) {
+            uint64_t pullStart = traceBegin(threadContext);
+            unsigned long pairCount = pullMergedGroups(jobContext, groups);
+            if (groups.empty()) {
+                break;
+            }
+            traceEnd(threadContext, "merge groups", pullStart, pairCount);
+            for (IntermediateVec &group : groups) {
+                reducePair(threadContext, group);
+            }
+            groups.clear();
+            reportProgress(threadContext, pairCount);
+            if (sliceExpired(threadContext)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    const std::vector<unsigned long> &offsets = jobContext->partitionOffsets;
+    const std::vector<unsigned long> &reduceItems = jobContext->reduceItems;
+    unsigned long groupCount = offsets.back();
+    unsigned long begin, end;
+    while (claimRange(threadContext, &begin, &end)) {
+        uint64_t taskStart = traceBegin(threadContext);
+        for (unsigned long index = begin; index < end; ++index) {
+            unsigned long groupIndex = reduceItems.empty() ? index : reduceItems[index];
+            if (groupIndex >= groupCount) {
+                reduceGroupPart(threadContext, groupIndex - groupCount);
+                continue;
+            }
+            // the partition holding the group is the last one starting at or before its index
+            auto partition = std::upper_bound(offsets.begin(), offsets.end(), groupIndex) - offsets.begin() - 1;
+            reducePair(threadContext, jobContext->shufflePartitions[partition][groupIndex - offsets[partition]]);
+        }
+        traceEnd(threadContext, "reduce task", taskStart, end - begin);
+        reportProgress(threadContext, end - begin);
+        if (sliceExpired(threadContext)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * The shuffle mode the job really uses, a job with one slot always uses the serial shuffle.
+ */
+shuffle_mode_t effectiveShuffleMode(JobContext *jobContext) {
+    shuffle_mode_t shuffleMode = jobContext->options.shuffleMode;
+    if (shuffleMode != HASH_SHUFFLE && jobContext->multiThreadLevel == 1) {
+        return SERIAL_SHUFFLE;
+    }
+    return shuffleMode;
+}
+
+/**
+ * Runs a job slot up to the end of its current phase, or until map or reduce yield the worker to
+ * another job. A slot never blocks: at the end of a phase it
+ * arrives at the job barrier and is parked, and the last slot to arrive prepares the next phase and
+ * makes all the slots of the job runnable again. The serial shuffle is done by the last slot to finish
+ * mapping, the parallel and hash shuffles let every slot group its own share of the keys.
+ * @param threadContext - the slot to run.
+ */
+void runSlot(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    shuffle_mode_t shuffleMode = effectiveShuffleMode(jobContext);
+    void (*lastArrival)(JobContext *);
+    uint64_t sortStart;
+    uint64_t shuffleStart;
+
+    JobPhases *phases = jobContext->phases;
+
+    switch (threadContext->phase) {
+        case MAP_PHASE:
+            if (phases != nullptr) {
+                if (!phases->map(phases->arg, threadContext->threadId, threadContext)) {
+                    yieldSlot(threadContext);
+                    return;
+                }
+                threadContext->phase = REDUCE_PHASE;
+                lastArrival = shufflePhasedJob;
+                break;
+            }
+            if (jobContext->inputChannel != nullptr) {
+                // a slot that stops early was queued again or parked on the channel, and may run already
+                if (!mapChannelSplits(threadContext)) {
+                    return;
+                }
+            } else if (!executeMapping(threadContext)) {
+                yieldSlot(threadContext);
+                return;
+            }
+            if (shuffleMode == HASH_SHUFFLE) {
+                threadContext->phase = SHUFFLE_PHASE;
+                lastArrival = configureShuffleEnvironment;
+                break;
+            }
+            sortStart = nowNanos();
+            sortIntermediatePairsByKeys(threadContext->intermediateVec);
+            addToCounter(threadContext->sortNanos, nowNanos() - sortStart);
+            traceEnd(threadContext, "sort", sortStart, threadContext->intermediateVec.size());
+            if (jobContext->options.pipelined) {
+                if (jobContext->mappingSlots.fetch_sub(1) != 1) {
+                    mergeFinishedRuns(threadContext);
+                }
+                threadContext->phase = REDUCE_PHASE;
+            } else if (shuffleMode == SERIAL_SHUFFLE) {
+                threadContext->phase = REDUCE_PHASE;
+            } else {
+                sampleIntermediatePairs(threadContext);
+                threadContext->phase = SHUFFLE_PHASE;
+            }
+            lastArrival = endMapStage;
+            break;
+        case SHUFFLE_PHASE:
+            shuffleStart = traceBegin(threadContext);
+            if (shuffleMode == HASH_SHUFFLE) {
+                executeHashShuffle(threadContext);
+                traceEnd(threadContext, "hash shuffle", shuffleStart, 0);
+            } else {
+                executeRangeShuffle(threadContext);
+                traceEnd(threadContext, "range merge", shuffleStart, 0);
+            }
+            threadContext->phase = REDUCE_PHASE;
+            lastArrival = InitReduceStage;
+            break;
+        default:
+            // the other slots read these vectors until the shuffle barrier, or to the end when streaming
+            if (jobContext->merge == nullptr) {
+                IntermediateVec().swap(threadContext->intermediateVec);
+                std::vector<IntermediateVec>().swap(threadContext->hashPartitions);
+            }
+            if (phases != nullptr ? !phases->reduce(phases->arg, threadContext->threadId, threadContext)
+                                  : !executeReduce(threadContext)) {
+                yieldSlot(threadContext);
+                return;
+            }
+            chargeSlot(threadContext);
+            finishSlot(threadContext);
+            return;
+    }
+
+    chargeSlot(threadContext);
+    // set before arriving, once the others arrived the slot may run again on another worker
+    threadContext->barrierArrival = threadContext->sliceStart;
+    if (jobContext->barrier->arrive(jobContext, lastArrival)) {
+        // the last slot did not wait, and prepared the next phase for the whole job
+        threadContext->barrierArrival = 0;
+        threadContext->slicePhase = SHUFFLE_PHASE;
+        chargeSlot(threadContext);
+        scheduleSlots(jobContext);
+    }
+}
+
+/**
+ * Counts a slot that finished reducing. The last slot splices the output and wakes the waiters of the job,
+ * the job may be freed as soon as the wait mutex is released.
+ * @param threadContext - the slot that finished.
+ */
+void finishSlot(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    // read before arriving, once the last slot finished the job may be freed
+    int slotCount = jobContext->multiThreadLevel;
+    OutputSink *outputSink = jobContext->options.outputSink;
+    if (outputSink != nullptr) {
+        outputSink->flush(threadContext->threadId);
+    }
+    if (jobContext->finishedThreads.fetch_add(1) + 1 != slotCount) {
+        return;
+    }
+    finishStreamingMerge(jobContext);
+    releaseArenas(jobContext);
+    spliceOutput(jobContext);
+    if (outputSink != nullptr) {
+        outputSink->close();
+    }
+    if (jobContext->phases != nullptr) {
+        jobContext->phases->finish(jobContext->phases->arg);
+    }
+    if (lockCounted(&jobContext->waitMutex) != 0) {
+        fprintf(stdout, "system error: on pthread_mutex_lock.\n");
+        exit(EXIT_FAILURE);
+    }
+    jobContext->finished = true;
+    if (pthread_cond_broadcast(&jobContext->conditionVar) != 0) {
+        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (pthread_mutex_unlock(&jobContext->waitMutex) != 0) {
+        fprintf(stdout, "system error: on pthread_mutex_unlock.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Moves the output of every thread into the job output vector, called once by the last thread to finish.
+ * The output vector is reserved to its final size first, so it is never reallocated while splicing.
+ * When the job keeps its output in chunks the thread outputs are left in place for getOutputChunks.
+ * @param jobContext - The context of the job containing all thread contexts.
+ */
+void spliceOutput(JobContext *jobContext) {
+    if (!jobContext->options.mergeOutput) {
+        return;
+    }
+    OutputVec *outputVec = jobContext->outputVec;
+    size_t totalSize = outputVec->size();
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        totalSize += jobContext->threadContexts[i].outputVec.size();
+    }
+    outputVec->reserve(totalSize);
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        OutputVec &threadOutput = jobContext->threadContexts[i].outputVec;
+        outputVec->insert(outputVec->end(), threadOutput.begin(), threadOutput.end());
+        OutputVec().swap(threadOutput);
+    }
+}
+
+/**
+ * Splits the items of a new stage into one contiguous block per thread. Runs while no thread
+ * takes tasks, at job start and in the barrier before reduce.
+ * @param jobContext - The context of the job containing all thread contexts.
+ * @param itemCount - The number of items in the stage.
+ */
+void distributeTasks(JobContext *jobContext, unsigned long itemCount) {
+    int threads = jobContext->multiThreadLevel;
+    for (int i = 0; i < threads; ++i) {
+        TaskDeque &tasks = jobContext->threadContexts[i].tasks;
+        tasks.ranges.clear();
+        unsigned long begin = itemCount * i / threads;
+        unsigned long end = itemCount * (i + 1) / threads;
+        if (begin < end) {
+            tasks.ranges.push_back({begin, end});
+        }
+    }
+}
+
+void lockTasks(TaskDeque &tasks) {
+    if (lockCounted(&tasks.mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock task queue mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void unlockTasks(TaskDeque &tasks) {
+    if (pthread_mutex_unlock(&tasks.mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock task queue mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Takes items from the front of the thread's own queue. The grain is JobOptions::taskGrain, or when it
+ * is 0 a share of the items left in the queue that shrinks as the queue drains (guided scheduling).
+ * @return false when the queue is empty.
+ */
+bool popTask(ThreadContext *threadContext, unsigned long *begin, unsigned long *end) {
+    TaskDeque &tasks = threadContext->tasks;
+    lockTasks(tasks);
+    if (tasks.ranges.empty()) {
+        unlockTasks(tasks);
+        return false;
+    }
+    unsigned long grain = threadContext->jobContext->options.taskGrain;
+    if (grain == 0) {
+        unsigned long left = 0;
+        for (const TaskRange &range : tasks.ranges) {
+            left += range.end - range.begin;
+        }
+        grain = std::max(1UL, left / GUIDED_FACTOR);
+    }
+    TaskRange &front = tasks.ranges.front();
+    *begin = front.begin;
+    *end = std::min(front.begin + grain, front.end);
+    front.begin = *end;
+    if (front.begin == front.end) {
+        tasks.ranges.pop_front();
+    }
+    unlockTasks(tasks);
+    return true;
+}
+
+/**
+ * Steals work from the back of another thread's queue into the calling thread's queue, half of the
+ * victim's last range, or the whole range when it holds a single item. Victims are tried in order,
+ * starting after the calling thread. Only one queue lock is held at a time.
+ * @return false when every other queue is empty.
+ */
+bool stealTask(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    int threads = jobContext->multiThreadLevel;
+    for (int i = 1; i < threads; ++i) {
+        TaskDeque &victim = jobContext->threadContexts[(threadContext->threadId + i) % threads].tasks;
+        lockTasks(victim);
+        if (victim.ranges.empty()) {
+            unlockTasks(victim);
+            continue;
+        }
+        TaskRange &back = victim.ranges.back();
+        TaskRange stolen = back;
+        if (back.end - back.begin > 1) {
+            stolen.begin = back.begin + (back.end - back.begin) / 2;
+            back.end = stolen.begin;
+        } else {
+            victim.ranges.pop_back();
+        }
+        unlockTasks(victim);
+
+        lockTasks(threadContext->tasks);
+        threadContext->tasks.ranges.push_back(stolen);
+        unlockTasks(threadContext->tasks);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Claims the next range of items of the current stage, [begin, end), from the thread's own queue,
+ * stealing from other threads when it is empty (unless JobOptions::workStealing is off).
+ * @param threadContext - Pointer to the ThreadContext structure associated with the thread.
+ * @param begin - Receives the first claimed index.
+ * @param end - Receives one past the last claimed index.
+ * @return false when no items are left.
+ */
+bool claimRange(ThreadContext *threadContext, unsigned long *begin, unsigned long *end) {
+    while (!popTask(threadContext, begin, end)) {
+        if (!threadContext->jobContext->options.workStealing) {
+            return false;
+        }
+        uint64_t stealStart = traceBegin(threadContext);
+        if (!stealTask(threadContext)) {
+            return false;
+        }
+        traceEnd(threadContext, "steal", stealStart, 0);
+    }
+    return true;
+}
+
+
+/**
+ * Packs a stage with its processed and total counts into a progress word.
+ * @param stage - the stage the job is in.
+ * @param processedItems - items of the stage already processed.
+ * @param totalItems - items the stage processes in total.
+ */
+uint64_t packProgress(stage_t stage, unsigned long processedItems, unsigned long totalItems) {
+    return (static_cast<uint64_t>(stage) << STAGE_SHIFT)
+           | (static_cast<uint64_t>(processedItems & INDEX_MASK) << PROCESSED_SHIFT)
+           | (totalItems & INDEX_MASK);
+}
+
+/**
+ * Adds processed items to the progress word of the job, without any lock.
+ * @param threadContext - Pointer to the ThreadContext structure associated with the thread.
+ * @param processedItems - The number of items processed since the last report.
+ */
+void reportProgress(ThreadContext *threadContext, unsigned long processedItems) {
+    threadContext->jobContext->counterAtomic->fetch_add(processedItems << PROCESSED_SHIFT,
+                                                        std::memory_order_relaxed);
+}
+
+/**
+ * Processes the next pair of key-value inputs and sends them to the map function.
+ * @param threadContext
+ * @param key - The key of the input pair.
+ * @param value - The value of the input pair.
+ */
+void processInputPair(ThreadContext *threadContext, const K1 *key, const V1 *value) {
+    JobContext *jobContext = threadContext->jobContext;
+    jobContext->mapReduceClient->map(key, value, threadContext);
+    if (jobContext->hasCombiner && threadContext->storedPairs >= threadContext->combineThreshold) {
+        combineIntermediatePairs(threadContext);
+    }
+    unsigned long budget = jobContext->slotPairBudget;
+    if (budget != 0 && threadContext->intermediateVec.size() >= budget) {
+        spillIntermediatePairs(threadContext);
+    }
+}
+
+/**
+ * Passes every run of equal keys in a vector sorted by key to the client combiner.
+ * Single pairs have nothing to combine and are emitted again as they are.
+ */
+void combineSortedPairs(ThreadContext *threadContext, const IntermediateVec &pairs) {
+    const MapReduceClient *client = threadContext->jobContext->mapReduceClient;
+    IntermediateVec group;
+    size_t begin = 0;
+    while (begin < pairs.size()) {
+        size_t end = begin + 1;
+        while (end < pairs.size() && !(*pairs[begin].first < *pairs[end].first)) {
+            ++end;
+        }
+        if (end - begin == 1) {
+            emit2(pairs[begin].first, pairs[begin].second, threadContext);
+        } else {
+            group.assign(pairs.begin() + begin, pairs.begin() + end);
+            client->combine(&group, threadContext);
+        }
+        begin = end;
+    }
+}
+
+/**
+ * Passes every set of equal keys in an unsorted vector to the client combiner, grouping with a hash table.
+ */
+void combineHashedPairs(ThreadContext *threadContext, const IntermediateVec &pairs) {
+    const MapReduceClient *client = threadContext->jobContext->mapReduceClient;
+    std::unordered_map<const K2 *, size_t, KeyHash, KeyEqual> groupOfKey;
+    std::vector<IntermediateVec> groups;
+    for (const IntermediatePair &pair : pairs) {
+        auto inserted = groupOfKey.insert(std::make_pair(pair.first, groups.size()));
+        if (inserted.second) {
+            groups.push_back(IntermediateVec());
+        }
+        groups[inserted.first->second].push_back(pair);
+    }
+    for (const IntermediateVec &group : groups) {
+        if (group.size() == 1) {
+            emit2(group[0].first, group[0].second, threadContext);
+        } else {
+            client->combine(&group, threadContext);
+        }
+    }
+}
+
+/**
+ * Runs the client combiner over all the pairs the thread holds, the combined pairs are emitted back
+ * into the thread buffers. Called when the thread holds combineThreshold pairs and once at the end of map.
+ * When combining does not halve the pairs, the threshold is doubled so the thread does not keep
+ * combining data that does not shrink.
+ * @param threadContext - ThreadContext structure associated with the thread
+ */
+void combineIntermediatePairs(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    if (!jobContext->hasCombiner || threadContext->storedPairs == 0) {
+        return;
+    }
+    unsigned long inputPairs = threadContext->storedPairs;
+    threadContext->combinerInputPairs.store(threadContext->combinerInputPairs.load(std::memory_order_relaxed)
+                                            + inputPairs, std::memory_order_relaxed);
+    threadContext->storedPairs = 0;
+    threadContext->combining = true;
+
+    if (jobContext->options.shuffleMode == HASH_SHUFFLE) {
+        std::vector<IntermediateVec> partitions(threadContext->hashPartitions.size());
+        partitions.swap(threadContext->hashPartitions);
+        for (const IntermediateVec &partition : partitions) {
+            combineHashedPairs(threadContext, partition);
+        }
+    } else {
+        IntermediateVec pairs;
+        pairs.swap(threadContext->intermediateVec);
+        uint64_t sortStart = nowNanos();
+        sortIntermediatePairsByKeys(pairs);
+        addToCounter(threadContext->sortNanos, nowNanos() - sortStart);
+        combineSortedPairs(threadContext, pairs);
+    }
+
+    threadContext->combining = false;
+    if (threadContext->storedPairs * 2 > inputPairs) {
+        threadContext->combineThreshold *= 2;
+    }
+}
+
+/**
+ * Passes a shuffled group to the span reduce function in place, and releases the group storage afterwards.
+ * @param threadContext - The context of the thread that is processing the group.
+ * @param group - The group of pairs with the same key, claimed by this thread only.
+ */
+void reducePair(ThreadContext *threadContext, IntermediateVec &group) {
+    IntermediateSpan span = {group.data(), group.data() + group.size(), &group};
+    (*(threadContext->jobContext->mapReduceClient)).reduce(span, threadContext);
+    addToCounter(threadContext->reducedGroups, 1);
+    IntermediateVec().swap(group);
+}
+
+void InitReduceStage(JobContext *jobContext) {
+    jobContext->partitionOffsets.assign(1, 0);
+    unsigned long largestGroupPairs = 0;
+    for (const std::vector<IntermediateVec> &partition : jobContext->shufflePartitions) {
+        jobContext->partitionOffsets.push_back(jobContext->partitionOffsets.back() + partition.size());
+        for (const IntermediateVec &group : partition) {
+            largestGroupPairs = std::max(largestGroupPairs, static_cast<unsigned long>(group.size()));
+        }
+    }
+    jobContext->largestGroupPairs = largestGroupPairs;
+    unsigned long groupCount = jobContext->partitionOffsets.back();
+    const MapReduceClient *client = jobContext->mapReduceClient;
+    std::vector<bool> groupIsSplit;
+    if (jobContext->multiThreadLevel > 1 && client->canMergePartials()) {
+        splitLargeGroups(jobContext, groupCount, groupIsSplit);
+    }
+    if (jobContext->multiThreadLevel > 1 && jobContext->options.largestGroupsFirst) {
+        queueLargestGroupsFirst(jobContext, groupCount, groupIsSplit);
+    } else if (!jobContext->groupParts.empty()) {
+        queueGroupParts(jobContext, groupCount, groupIsSplit);
+    } else {
+        distributeTasks(jobContext, groupCount);
+    }
+    unsigned long itemCount = jobContext->reduceItems.empty() ? groupCount : jobContext->reduceItems.size();
+    jobContext->counterAtomic->store(packProgress(REDUCE_STAGE, 0, itemCount));
+}
+
+/**
+ * Splits the groups larger than JobOptions::splitGroupPairs into parts, at most one per thread.
+ * @param jobContext - The context of the job, at the end of the shuffle.
+ * @param groupCount - The number of shuffled groups.
+ * @param groupIsSplit - receives whether every group was split, left empty when none was.
+ */
+void splitLargeGroups(JobContext *jobContext, unsigned long groupCount, std::vector<bool> &groupIsSplit) {
+    int threads = jobContext->multiThreadLevel;
+    unsigned long splitPairs = jobContext->options.splitGroupPairs;
+    if (splitPairs == 0) {
+        splitPairs = jobContext->shufflePairCount.load() / (2 * threads);
+    }
+    splitPairs = std::max(splitPairs, static_cast<unsigned long>(MIN_SPLIT_GROUP_PAIRS));
+    if (jobContext->largestGroupPairs <= splitPairs) {
+        return;
+    }
+
+    groupIsSplit.assign(groupCount, false);
+    unsigned long groupIndex = 0;
+    for (std::vector<IntermediateVec> &partition : jobContext->shufflePartitions) {
+        for (IntermediateVec &group : partition) {
+            if (group.size() > splitPairs) {
+                int partCount = static_cast<int>(std::min((group.size() + splitPairs - 1) / splitPairs,
+                                                          static_cast<size_t>(threads)));
+                int leafCount = 1;
+                while (leafCount < partCount) {
+                    leafCount *= 2;
+                }
+                jobContext->splitGroups.emplace_back();
+                SplitGroup &splitGroup = jobContext->splitGroups.back();
+                splitGroup.group = &group;
+                splitGroup.partCount = partCount;
+                splitGroup.leafCount = leafCount;
+                splitGroup.partials.resize(2 * leafCount);
+                std::vector<std::atomic<int>>(leafCount).swap(splitGroup.arrivals);
+                for (int part = 0; part < partCount; ++part) {
+                    jobContext->groupParts.push_back({&splitGroup, part, group.size() * part / partCount,
+                                                      group.size() * (part + 1) / partCount});
+                }
+                groupIsSplit[groupIndex] = true;
+            }
+            ++groupIndex;
+        }
+    }
+}
+
+/**
+ * Queues the parts of the split groups round robin, so every thread starts with the parts it was given,
+ * followed by one contiguous block of the whole groups per thread, as without split groups.
+ * @param jobContext - The context of the job, at the end of the shuffle.
+ * @param groupCount - The number of shuffled groups.
+ * @param groupIsSplit - whether every group was split.
+ */
+void queueGroupParts(JobContext *jobContext, unsigned long groupCount, const std::vector<bool> &groupIsSplit) {
+    int threads = jobContext->multiThreadLevel;
+    std::vector<unsigned long> wholeGroups;
+    for (unsigned long i = 0; i < groupCount; ++i) {
+        if (!groupIsSplit[i]) {
+            wholeGroups.push_back(i);
+        }
+    }
+    std::vector<unsigned long> &reduceItems = jobContext->reduceItems;
+    for (int i = 0; i < threads; ++i) {
+        TaskDeque &tasks = jobContext->threadContexts[i].tasks;
+        tasks.ranges.clear();
+        unsigned long begin = reduceItems.size();
+        for (size_t part = i; part < jobContext->groupParts.size(); part += threads) {
+            reduceItems.push_back(groupCount + part);
+        }
+        reduceItems.insert(reduceItems.end(), wholeGroups.begin() + wholeGroups.size() * i / threads,
+                           wholeGroups.begin() + wholeGroups.size() * (i + 1) / threads);
+        if (begin < reduceItems.size()) {
+            tasks.ranges.push_back({begin, reduceItems.size()});
+        }
+    }
+}
+
+/**
+ * A reduce item with its estimated cost, for the largest first order.
+ */
+struct CostedItem {
+    unsigned long cost;
+    unsigned long item;
+};
+
+/**
+ * Queues the reduce items longest processing time first: the items are sorted by the cost the client
+ * estimates (the group size by default), and every item goes to the thread with the least cost queued so
+ * far. Every thread so takes its most expensive items first, and thieves take the cheapest from the back.
+ * @param jobContext - The context of the job, at the end of the shuffle.
+ * @param groupCount - The number of shuffled groups.
+ * @param groupIsSplit - whether every group was split, empty when none was.
+ */
+void queueLargestGroupsFirst(JobContext *jobContext, unsigned long groupCount,
+                             const std::vector<bool> &groupIsSplit) {
+    const MapReduceClient *client = jobContext->mapReduceClient;
+    std::vector<CostedItem> items;
+    items.reserve(groupCount + jobContext->groupParts.size());
+    unsigned long groupIndex = 0;
+    for (const std::vector<IntermediateVec> &partition : jobContext->shufflePartitions) {
+        for (const IntermediateVec &group : partition) {
+            if (groupIsSplit.empty() || !groupIsSplit[groupIndex]) {
+                items.push_back({client->reduceCost(group.front().first, group.size()), groupIndex});
+            }
+            ++groupIndex;
+        }
+    }
+    for (size_t part = 0; part < jobContext->groupParts.size(); ++part) {
+        const GroupPart &groupPart = jobContext->groupParts[part];
+        const K2 *key = groupPart.splitGroup->group->front().first;
+        items.push_back({client->reduceCost(key, groupPart.end - groupPart.begin), groupCount + part});
+    }
+    std::stable_sort(items.begin(), items.end(), [](const CostedItem &a, const CostedItem &b) {
+        return a.cost > b.cost;
+    });
+
+    // a min heap of (queued cost, thread)
+    int threads = jobContext->multiThreadLevel;
+    std::vector<std::pair<unsigned long, int>> loads;
+    for (int i = 0; i < threads; ++i) {
+        loads.push_back(std::make_pair(0UL, i));
+    }
+    std::vector<std::vector<unsigned long>> threadItems(threads);
+    for (const CostedItem &item : items) {
+        std::pop_heap(loads.begin(), loads.end(), std::greater<std::pair<unsigned long, int>>());
+        threadItems[loads.back().second].push_back(item.item);
+        loads.back().first += item.cost;
+        std::push_heap(loads.begin(), loads.end(), std::greater<std::pair<unsigned long, int>>());
+    }
+
+    std::vector<unsigned long> &reduceItems = jobContext->reduceItems;
+    reduceItems.clear();
+    for (int i = 0; i < threads; ++i) {
+        TaskDeque &tasks = jobContext->threadContexts[i].tasks;
+        tasks.ranges.clear();
+        unsigned long begin = reduceItems.size();
+        reduceItems.insert(reduceItems.end(), threadItems[i].begin(), threadItems[i].end());
+        if (begin < reduceItems.size()) {
+            tasks.ranges.push_back({begin, reduceItems.size()});
+        }
+    }
+}
+
+/**
+ * The first part under a node of the merge tree of a split group.
+ */
+int firstLeafUnder(const SplitGroup &splitGroup, int node) {
+    while (node < splitGroup.leafCount) {
+        node *= 2;
+    }
+    return node - splitGroup.leafCount;
+}
+
+/**
+ * Reduces a part of a split group into its partial result, then walks up the merge tree: the second
+ * child of a node to finish merges both partial results into the node with the client mergePartials,
+ * and the merge at the root is emitted as the output of the group. Nodes with a single part under them
+ * take its partial result as it is.
+ * @param threadContext - the slot reducing the part.
+ * @param partIndex - the index of the part in JobContext::groupParts.
+ */
+void reduceGroupPart(ThreadContext *threadContext, unsigned long partIndex) {
+    JobContext *jobContext = threadContext->jobContext;
+    const MapReduceClient *client = jobContext->mapReduceClient;
+    GroupPart &part = jobContext->groupParts[partIndex];
+    SplitGroup &splitGroup = *part.splitGroup;
+    int node = splitGroup.leafCount + part.leaf;
+    const IntermediatePair *pairs = splitGroup.group->data();
+    IntermediateSpan span = {pairs + part.begin, pairs + part.end, nullptr};
+    threadContext->partialOutput = &splitGroup.partials[node];
+    client->reduce(span, threadContext);
+    addToCounter(threadContext->reducedGroups, 1);
+    threadContext->partialOutput = nullptr;
+
+    while (node > 1) {
+        int parent = node / 2;
+        bool hasRightChild = firstLeafUnder(splitGroup, 2 * parent + 1) < splitGroup.partCount;
+        // the first child to finish leaves its partial result to the second
+        if (hasRightChild && splitGroup.arrivals[parent].fetch_add(1, std::memory_order_acq_rel) == 0) {
+            return;
+        }
+        OutputVec &left = splitGroup.partials[2 * parent];
+        if (!hasRightChild) {
+            splitGroup.partials[parent].swap(left);
+        } else {
+            OutputVec &right = splitGroup.partials[2 * parent + 1];
+            OutputVec partials;
+            partials.reserve(left.size() + right.size());
+            partials.insert(partials.end(), left.begin(), left.end());
+            partials.insert(partials.end(), right.begin(), right.end());
+            OutputVec().swap(left);
+            OutputVec().swap(right);
+            // the root emits the result of the group
+            threadContext->partialOutput = parent == 1 ? nullptr : &splitGroup.partials[parent];
+            client->mergePartials(&partials, threadContext);
+            threadContext->partialOutput = nullptr;
+            addToCounter(threadContext->partialMerges, 1);
+        }
+        node = parent;
+    }
+    IntermediateVec().swap(*splitGroup.group);
+}
+
+
+/**
+ *  Configures the environment for the shuffle stage of the job.
+ * @param jobDetails - The JobContext structure
+ */
+void configureShuffleEnvironment(JobContext *jobDetails) {
+    // Compute the total number of key-value pairs across all threads
+    unsigned long pairCount = 0;
+    for (int idx = 0; idx < jobDetails->multiThreadLevel; idx++) {
+        pairCount += (jobDetails->threadContexts + idx)->intermediateVec.size();
+        for (const IntermediateVec &partition : (jobDetails->threadContexts + idx)->hashPartitions) {
+            pairCount += partition.size();
+        }
+    }
+    jobDetails->shufflePairCount = pairCount;
+    jobDetails->shufflePartitions.resize(jobDetails->multiThreadLevel);
+
+    // Move the job to the shuffle stage with the pair count as its total
+    jobDetails->counterAtomic->store(packProgress(SHUFFLE_STAGE, 0, pairCount));
+}
+
+
+/**
+ * A sorted run taking part in the k-way merge of the shuffle. The run is read from its back, so the
+ * merge yields the groups from the largest key to the smallest, like the reduce queues expect.
+ */
+typedef std::reverse_iterator<const IntermediatePair *> RunCursor;
+typedef std::pair<RunCursor, RunCursor> MergeRun;
+
+MergeRun backwardRun(const IntermediatePair *begin, const IntermediatePair *end) {
+    return MergeRun(RunCursor(end), RunCursor(begin));
+}
+
+bool pairHasLargerKey(const IntermediatePair &a, const IntermediatePair &b) {
+    return *b.first < *a.first;
+}
+
+/**
+ * Collects the groups of the shuffle merge and counts their pairs as shuffled.
+ */
+struct GroupCollector {
+    std::vector<IntermediateVec> &groups;
+    JobContext *jobContext;
+
+    void operator()(const std::vector<MergeRun> &chunks) {
+        IntermediateVec group;
+        for (const MergeRun &chunk : chunks) {
+            group.insert(group.end(), chunk.first, chunk.second);
+        }
+        unsigned long groupSize = group.size();
+        groups.push_back(std::move(group));
+        updateShuffleProgress(jobContext, groupSize);
+    }
+};
+
+/**
+ * Merges sorted runs into groups of equal keys, from the largest key to the smallest, with the k-way
+ * merge of ShuffleMerge.h.
+ * @param runs - the sorted runs to merge, empty runs are allowed.
+ * @param groups - vector that receives one group per distinct key.
+ * @param jobContext - the job whose shuffle progress is updated after every group.
+ */
+void mergeRuns(std::vector<MergeRun> &runs, std::vector<IntermediateVec> &groups, JobContext *jobContext) {
+    GroupCollector collector = {groups, jobContext};
+    mergeSortedRuns(runs, pairHasLargerKey, collector);
+}
+
+
+/**
+ * Updates the shuffle progress in the job context based on current state.
+ * @param jobContext  - The context of the job containing all thread contexts and vectors.
+ * @param mergedPairs - The number of pairs grouped since the last update.
+ */
+void updateShuffleProgress(JobContext *jobContext, unsigned long mergedPairs) {
+    jobContext->counterAtomic->fetch_add(static_cast<uint64_t>(mergedPairs) << PROCESSED_SHIFT,
+                                         std::memory_order_relaxed);
+}
+
+/**
+ * Writes a buffer of spill records to the spill file and empties it.
+ */
+void writeSpillBuffer(FILE *file, std::vector<char> &buffer) {
+    if (!buffer.empty() && fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size()) {
+        fprintf(stdout, "system error: Unable to write a spill file.\n");
+        exit(EXIT_FAILURE);
+    }
+    buffer.clear();
+}
+
+/**
+ * Opens a new temporary file for a spill run.
+ */
+FILE *createSpillFile() {
+    FILE *file = tmpfile();
+    if (file == nullptr) {
+        fprintf(stdout, "system error: Unable to create a spill file.\n");
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+/**
+ * Appends the spill record of a pair to a buffer: the length of the serialized pair, then its bytes.
+ */
+void appendSpillRecord(const IntermediateSerializer *serializer, const IntermediatePair &pair,
+                       std::vector<char> &buffer) {
+    size_t lengthOffset = buffer.size();
+    buffer.resize(lengthOffset + sizeof(uint32_t));
+    serializer->serialize(pair.first, pair.second, buffer);
+    auto length = static_cast<uint32_t>(buffer.size() - lengthOffset - sizeof(uint32_t));
+    memcpy(buffer.data() + lengthOffset, &length, sizeof(length));
+}
+
+/**
+ * Sorts the intermediate pairs of the slot and writes them to a new temporary file as one sorted run.
+ * The pairs are released through the serializer, except for keys and values in the arena of the slot: no
+ * pair refers to the arena after the spill, so its blocks are freed at once. The vector keeps its capacity
+ * for the next run, so a slot never holds more than its share of the memory budget.
+ * @param threadContext - ThreadContext structure associated with the thread
+ */
+void spillIntermediatePairs(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    const IntermediateSerializer *serializer = jobContext->options.serializer;
+    IntermediateVec &pairs = threadContext->intermediateVec;
+    std::vector<ArenaBlock> arenaBlocks(threadContext->arena.blocks);
+    std::sort(arenaBlocks.begin(), arenaBlocks.end(), [](const ArenaBlock &a, const ArenaBlock &b) {
+        return reinterpret_cast<uintptr_t>(a.memory) < reinterpret_cast<uintptr_t>(b.memory);
+    });
+    uint64_t sortStart = nowNanos();
+    sortIntermediatePairsByKeys(pairs);
+    addToCounter(threadContext->sortNanos, nowNanos() - sortStart);
+    uint64_t spillStart = traceBegin(threadContext);
+
+    FILE *file = createSpillFile();
+    std::vector<char> buffer;
+    for (const IntermediatePair &pair : pairs) {
+        appendSpillRecord(serializer, pair, buffer);
+        if (arenaBlocks.empty()) {
+            serializer->release(pair.first, pair.second);
+        } else {
+            K2 *key = arenaHolds(arenaBlocks, pair.first) ? nullptr : pair.first;
+            V2 *value = arenaHolds(arenaBlocks, pair.second) ? nullptr : pair.second;
+            if (key != nullptr || value != nullptr) {
+                serializer->release(key, value);
+            }
+        }
+        if (buffer.size() >= SPILL_BUFFER_SIZE) {
+            writeSpillBuffer(file, buffer);
+        }
+    }
+    writeSpillBuffer(file, buffer);
+
+    threadContext->spillRuns.push_back({file, pairs.size()});
+    traceEnd(threadContext, "spill", spillStart, pairs.size());
+    addToCounter(threadContext->spilledPairs, pairs.size());
+    addToCounter(threadContext->spillRunCount, 1);
+    pairs.clear();
+    resetArena(threadContext->arena);
+    threadContext->storedPairs = 0;
+    jobContext->spilled.store(true, std::memory_order_relaxed);
+    if (threadContext->spillRuns.size() > MAX_SPILL_RUNS) {
+        mergeSpillRuns(threadContext);
+    }
+}
+
+/**
+ * Merges the SPILL_MERGE_FAN_IN smallest spill runs of the slot into one new run and closes their files,
+ * so a slot never holds more than MAX_SPILL_RUNS open files however much it spills. Merging the smallest
+ * runs keeps the runs growing geometrically, so every pair is rewritten only a logarithmic number of
+ * times. The pairs are read back with the serializer, written again and released.
+ * @param threadContext - a slot with more than MAX_SPILL_RUNS spill runs.
+ */
+void mergeSpillRuns(ThreadContext *threadContext) {
+    const IntermediateSerializer *serializer = threadContext->jobContext->options.serializer;
+    std::vector<SpillRun> &runs = threadContext->spillRuns;
+    uint64_t mergeStart = traceBegin(threadContext);
+    std::sort(runs.begin(), runs.end(), [](const SpillRun &a, const SpillRun &b) {
+        return a.pairCount < b.pairCount;
+    });
+
+    std::vector<MergeSource> sources;
+    std::vector<size_t> heap;
+    std::vector<char> record;
+    unsigned long pairCount = 0;
+    for (size_t i = 0; i < SPILL_MERGE_FAN_IN; ++i) {
+        rewind(runs[i].file);
+        sources.push_back({nullptr, nullptr, runs[i].file, runs[i].pairCount, IntermediatePair()});
+        pairCount += runs[i].pairCount;
+        if (advanceMergeSource(sources.back(), serializer, record)) {
+            heap.push_back(i);
+        }
+    }
+    auto hasLargerHead = [&sources](size_t a, size_t b) {
+        return *sources[b].head.first < *sources[a].head.first;
+    };
+    std::make_heap(heap.begin(), heap.end(), hasLargerHead);
+
+    FILE *file = createSpillFile();
+    std::vector<char> buffer;
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), hasLargerHead);
+        MergeSource &source = sources[heap.back()];
+        appendSpillRecord(serializer, source.head, buffer);
+        serializer->release(source.head.first, source.head.second);
+        if (buffer.size() >= SPILL_BUFFER_SIZE) {
+            writeSpillBuffer(file, buffer);
+        }
+        if (advanceMergeSource(source, serializer, record)) {
+            std::push_heap(heap.begin(), heap.end(), hasLargerHead);
+        } else {
+            heap.pop_back();
+        }
+    }
+    writeSpillBuffer(file, buffer);
+
+    for (size_t i = 0; i < SPILL_MERGE_FAN_IN; ++i) {
+        fclose(runs[i].file);
+    }
+    runs.erase(runs.begin(), runs.begin() + SPILL_MERGE_FAN_IN);
+    runs.push_back({file, pairCount});
+    traceEnd(threadContext, "merge spill runs", mergeStart, pairCount);
+    addToCounter(threadContext->spillMergeCount, 1);
+}
+
+/**
+ * Merges the sorted run of a slot that finished mapping with the runs other finished slots left, while
+ * some slot still maps. Runs are merged in pairs of the same level like a binary counter: a run of level l
+ * was merged from 2^l runs, the slot takes the pending run of the level of its own run and merges it in,
+ * one level up, until no run of its level is pending, then leaves its run pending at that level. Every pair
+ * is so copied once per level, O(n log k) for k runs, and at most log k + 1 runs are left for reduce. A
+ * pending slot only ever has its run taken, it already finished mapping.
+ * @param threadContext - a slot that finished mapping and sorted its run.
+ */
+void mergeFinishedRuns(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    IntermediateVec &run = threadContext->intermediateVec;
+    IntermediateVec merged;
+    size_t level = 0;
+    while (jobContext->mappingSlots.load() != 0) {
+        if (lockCounted(&jobContext->pipelineMutex) != 0) {
+            fprintf(stdout, "system error: Unable to lock pipeline mutex.\n");
+            exit(EXIT_FAILURE);
+        }
+        std::vector<ThreadContext *> &pendingRuns = jobContext->pendingRuns;
+        if (pendingRuns.size() <= level) {
+            pendingRuns.resize(level + 1, nullptr);
+        }
+        ThreadContext *pendingSlot = pendingRuns[level];
+        pendingRuns[level] = pendingSlot == nullptr ? threadContext : nullptr;
+        if (pthread_mutex_unlock(&jobContext->pipelineMutex) != 0) {
+            fprintf(stdout, "system error: Unable to unlock pipeline mutex.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (pendingSlot == nullptr) {
+            return;
+        }
+        IntermediateVec &pendingRun = pendingSlot->intermediateVec;
+        uint64_t mergeStart = traceBegin(threadContext);
+        merged.reserve(run.size() + pendingRun.size());
+        std::merge(pendingRun.begin(), pendingRun.end(), run.begin(), run.end(), std::back_inserter(merged),
+                   [](const IntermediatePair &a, const IntermediatePair &b) {
+                       return *a.first < *b.first;
+                   });
+        run.swap(merged);
+        IntermediateVec().swap(merged);
+        IntermediateVec().swap(pendingRun);
+        traceEnd(threadContext, "merge runs", mergeStart, run.size());
+        ++level;
+    }
+}
+
+/**
+ * Ends the map stage, run by the last slot to finish mapping. A job that spilled or is pipelined skips
+ * the shuffle and streams the merge of its runs into reduce, other jobs shuffle in memory.
+ * @param jobContext - The context of the job containing all thread contexts and vectors.
+ */
+void endMapStage(JobContext *jobContext) {
+    if (jobContext->spilled.load(std::memory_order_relaxed) || jobContext->options.pipelined) {
+        startStreamingMerge(jobContext);
+    } else if (effectiveShuffleMode(jobContext) == SERIAL_SHUFFLE) {
+        executeShuffleOperation(jobContext);
+    } else {
+        configureShuffleEnvironment(jobContext);
+    }
+}
 
+/**
+ * Moves a merge source to its next pair, reading and deserializing it for spill runs.
+ * @return false when the source has no pairs left.
+ */
+bool advanceMergeSource(MergeSource &source, const IntermediateSerializer *serializer, std::vector<char> &record) {
+    if (source.file == nullptr) {
+        if (source.next == source.end) {
+            return false;
+        }
+        source.head = *source.next++;
+        return true;
+    }
+    if (source.remaining == 0) {
+        return false;
+    }
+    uint32_t length;
+    if (fread(&length, sizeof(length), 1, source.file) != 1) {
+        fprintf(stdout, "system error: Unable to read a spill file.\n");
+        exit(EXIT_FAILURE);
+    }
+    record.resize(length);
+    if (length != 0 && fread(record.data(), 1, length, source.file) != length) {
+        fprintf(stdout, "system error: Unable to read a spill file.\n");
+        exit(EXIT_FAILURE);
+    }
+    serializer->deserialize(record.data(), length, &source.head.first, &source.head.second);
+    --source.remaining;
+    return true;
+}
+
+/**
+ * Builds the streaming merge over the spill runs and the in-memory pairs of all slots and moves every
+ * slot to reduce, run by the last slot to finish mapping. Reduce progress counts pairs, since the
+ * number of groups is not known before the merge.
+ * @param jobContext - The context of the job containing all thread contexts and vectors.
+ */
+void startStreamingMerge(JobContext *jobContext) {
+    auto *merge = new StreamingMerge;
+    merge->mutex = PTHREAD_MUTEX_INITIALIZER;
+    unsigned long pairCount = 0;
     for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
-        IntermediateVec &vec = jobContext->threadContexts[i].intermediateVec;
+        ThreadContext &threadContext = jobContext->threadContexts[i];
+        for (const SpillRun &run : threadContext.spillRuns) {
+            rewind(run.file);
+            merge->sources.push_back({nullptr, nullptr, run.file, run.pairCount, IntermediatePair()});
+            pairCount += run.pairCount;
+        }
+        const IntermediateVec &pairs = threadContext.intermediateVec;
+        merge->sources.push_back({pairs.data(), pairs.data() + pairs.size(), nullptr, 0, IntermediatePair()});
+        pairCount += pairs.size();
+        threadContext.phase = REDUCE_PHASE;
+        threadContext.tasks.ranges.clear();
+    }
+    for (size_t i = 0; i < merge->sources.size(); ++i) {
+        if (advanceMergeSource(merge->sources[i], jobContext->options.serializer, merge->record)) {
+            merge->heap.push_back(i);
+        }
+    }
+    jobContext->merge = merge;
+    std::make_heap(merge->heap.begin(), merge->heap.end(), SourceHasLargerHead(merge));
+    jobContext->shufflePairCount = pairCount;
+    jobContext->counterAtomic->store(packProgress(REDUCE_STAGE, 0, pairCount));
+}
 
-        // Use a reverse iterator to efficiently pop from the back of the vector
-        for (auto rit = vec.rbegin(); rit != vec.rend();) {
-            if (!(*rit->first < *largestPair.first) && !(*largestPair.first < *rit->first)) {
-                collectedPairs.push_back(*rit);
-                rit = std::vector<IntermediatePair>::reverse_iterator(
-                        vec.erase((++rit).base())); // Erase and move iterator back to the next element
+/**
+ * Takes the next groups of equal keys from the streaming merge, whole groups of about MERGE_BATCH_PAIRS
+ * pairs together, so a reduce slot takes the merge mutex once per batch and not once per group.
+ * @param jobContext - the job, which streams a merge.
+ * @param groups - empty vector that receives the groups, left empty when all groups were taken.
+ * @return the number of pairs taken.
+ */
+unsigned long pullMergedGroups(JobContext *jobContext, std::vector<IntermediateVec> &groups) {
+    StreamingMerge *merge = jobContext->merge;
+    if (lockCounted(&merge->mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock merge mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    std::vector<size_t> &heap = merge->heap;
+    SourceHasLargerHead hasLargerHead(merge);
+    unsigned long pairCount = 0;
+    while (!heap.empty() && pairCount < MERGE_BATCH_PAIRS) {
+        groups.emplace_back();
+        IntermediateVec &group = groups.back();
+        const K2 *key = merge->sources[heap.front()].head.first;
+        // every head on top of the heap that is not above the key is equal to it
+        while (!heap.empty() && !(*key < *merge->sources[heap.front()].head.first)) {
+            std::pop_heap(heap.begin(), heap.end(), hasLargerHead);
+            MergeSource &source = merge->sources[heap.back()];
+            // the pairs of the key are consecutive in the run, so the heap is fixed once per run and group
+            bool hasHead;
+            do {
+                group.push_back(source.head);
+                hasHead = advanceMergeSource(source, jobContext->options.serializer, merge->record);
+            } while (hasHead && !(*key < *source.head.first));
+            if (hasHead) {
+                std::push_heap(heap.begin(), heap.end(), hasLargerHead);
             } else {
-                break; // Since we're assuming vec is sorted, or we are looking for the largest key until mismatch
+                heap.pop_back();
             }
         }
+        pairCount += group.size();
     }
-
-    return collectedPairs;
+    if (pthread_mutex_unlock(&merge->mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock merge mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+    return pairCount;
 }
 
-
 /**
- * Updates the shuffle progress in the job context based on current state.
- * @param jobContext  - The context of the job containing all thread contexts and vectors.
+ * Closes the spill files and frees the streaming merge, called once by the last slot to finish reducing.
+ * @param jobContext - The context of the job containing all thread contexts and vectors.
  */
-void updateShuffleProgress(JobContext *jobContext) {
-    jobContext->jobState.percentage = static_cast<float>(jobContext->shuffleArray.size())
-                                      / jobContext->maxSize * 100.0f;
+void finishStreamingMerge(JobContext *jobContext) {
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        ThreadContext &threadContext = jobContext->threadContexts[i];
+        for (const SpillRun &run : threadContext.spillRuns) {
+            fclose(run.file);
+        }
+        std::vector<SpillRun>().swap(threadContext.spillRuns);
+        IntermediateVec().swap(threadContext.intermediateVec);
+    }
+    StreamingMerge *merge = jobContext->merge;
+    if (merge == nullptr) {
+        return;
+    }
+    if (pthread_mutex_destroy(&merge->mutex) != 0) {
+        fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+        exit(EXIT_FAILURE);
+    }
+    delete merge;
+    jobContext->merge = nullptr;
 }
 
 /**
- * Executes the shuffle operation, organizing data into shuffled arrays by key.
+ * Executes the shuffle operation and prepares the reduce stage, run by the last thread to reach the barrier.
  * @param jobContext - The context of the job containing all thread contexts and vectors.
  */
 void executeShuffleOperation(JobContext *jobContext) {
+    executeSerialShuffle(jobContext);
+    InitReduceStage(jobContext);
+}
+
+/**
+ * Organizes the data of all threads into one partition of groups by key.
+ * The sorted intermediate vectors of all threads are merged with one k-way merge and released afterwards.
+ * @param jobContext - The context of the job containing all thread contexts and vectors.
+ */
+void executeSerialShuffle(JobContext *jobContext) {
+    // runs in the last slot to finish mapping
+    uint64_t shuffleStart = traceBegin(runningSlot);
     configureShuffleEnvironment(jobContext);
+    jobContext->shufflePartitions.resize(1);
 
-    while (jobContext->jobState.percentage < 100) {
-        IntermediatePair largestPair = findLargestKey(jobContext);
-        if (!largestPair.first) { // No more pairs available, stop the shuffle
-            break;
-        }
+    std::vector<MergeRun> runs;
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        IntermediateVec &vec = jobContext->threadContexts[i].intermediateVec;
+        runs.push_back(backwardRun(vec.data(), vec.data() + vec.size()));
+    }
+    mergeRuns(runs, jobContext->shufflePartitions[0], jobContext);
+
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        IntermediateVec().swap(jobContext->threadContexts[i].intermediateVec);
+    }
+    traceEnd(runningSlot, "serial merge", shuffleStart, jobContext->shufflePairCount.load(std::memory_order_relaxed));
+}
+
+/**
+ * Takes evenly spaced keys from the sorted intermediate vector of the thread.
+ * @param threadContext - ThreadContext structure associated with the thread
+ */
+void sampleIntermediatePairs(ThreadContext *threadContext) {
+    threadContext->samples.clear();
+    sampleSortedRun(threadContext->intermediateVec, [](const IntermediatePair &pair) { return pair.first; },
+                    threadContext->samples);
+}
+
+bool pairHasSmallerKey(const IntermediatePair &pair, const K2 *key) {
+    return *pair.first < *key;
+}
+
+bool keyIsSmaller(const K2 *a, const K2 *b) {
+    return *a < *b;
+}
+
+/**
+ * Merges the key range of the calling thread from the sorted vectors of all threads.
+ * Every thread sorts the samples of all threads and cuts the same key ranges with keyRangeOfRun,
+ * thread i then merges range i of every vector.
+ * @param threadContext - ThreadContext structure associated with the thread
+ */
+void executeRangeShuffle(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    int threads = jobContext->multiThreadLevel;
+    int range = threadContext->threadId;
+
+    std::vector<K2 *> samples;
+    for (int i = 0; i < threads; ++i) {
+        const std::vector<K2 *> &threadSamples = jobContext->threadContexts[i].samples;
+        samples.insert(samples.end(), threadSamples.begin(), threadSamples.end());
+    }
+    std::sort(samples.begin(), samples.end(), keyIsSmaller);
+
+    std::vector<MergeRun> runs;
+    for (int i = 0; i < threads; ++i) {
+        const IntermediateVec &vec = jobContext->threadContexts[i].intermediateVec;
+        std::pair<const IntermediatePair *, const IntermediatePair *> part =
+                keyRangeOfRun(vec.data(), vec.data() + vec.size(), samples, range, threads, pairHasSmallerKey);
+        runs.push_back(backwardRun(part.first, part.second));
+    }
+    mergeRuns(runs, jobContext->shufflePartitions[range], jobContext);
+}
+
+
+/**
+ * Groups the hash partition of the calling thread from the scattered pairs of all threads.
+ * Keys are grouped with a hash table in the order they are first seen, no sorting is done.
+ * @param threadContext - ThreadContext structure associated with the thread
+ */
+void executeHashShuffle(ThreadContext *threadContext) {
+    JobContext *jobContext = threadContext->jobContext;
+    int partition = threadContext->threadId;
+    std::vector<IntermediateVec> &groups = jobContext->shufflePartitions[partition];
+    std::unordered_map<const K2 *, size_t, KeyHash, KeyEqual> groupOfKey;
 
-        std::vector<IntermediatePair> matchedPairs = collectPairsWithKey(jobContext, largestPair);
-        if (!matchedPairs.empty()) {
-            jobContext->shuffleArray.push_back(matchedPairs);
-            updateShuffleProgress(jobContext);
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        const IntermediateVec &pairs = jobContext->threadContexts[i].hashPartitions[partition];
+        for (const IntermediatePair &pair : pairs) {
+            auto inserted = groupOfKey.insert(std::make_pair(pair.first, groups.size()));
+            if (inserted.second) {
+                groups.push_back(IntermediateVec());
+            }
+            groups[inserted.first->second].push_back(pair);
         }
+        updateShuffleProgress(jobContext, pairs.size());
     }
 }
 
 
 /**
- * Sorts the intermediate vector for the current thread based on keys
- * @param threadCtx - ThreadContext structure associated with the thread
+ * A pair with the normalized prefix of its key, the record moved by the radix sort.
+ */
+struct PrefixedPair {
+    uint64_t prefix;
+    IntermediatePair pair;
+};
+
+bool prefixedPairHasSmallerKey(const PrefixedPair &a, const PrefixedPair &b) {
+    return *a.pair.first < *b.pair.first;
+}
+
+/**
+ * Sorts pairs by the normalized prefixes of their keys with an LSD radix sort, RADIX_BITS per pass.
+ * The histograms of all passes are counted in one read, and passes in which all the records share
+ * the digit are skipped. Runs of equal prefixes are then sorted with operator<, unless prefixes are exact.
+ * @param pairs - the pairs to sort.
+ * @return false, with pairs untouched, when the keys have no normalized prefix.
+ */
+bool radixSortPairs(IntermediateVec &pairs) {
+    uint64_t firstPrefix;
+    if (!pairs.front().first->normalizedPrefix(&firstPrefix)) {
+        return false;
+    }
+    size_t pairCount = pairs.size();
+    std::vector<PrefixedPair> records(pairCount);
+    std::vector<std::vector<size_t>> counts(RADIX_PASSES, std::vector<size_t>(1 << RADIX_BITS, 0));
+    for (size_t i = 0; i < pairCount; ++i) {
+        PrefixedPair &record = records[i];
+        record.pair = pairs[i];
+        if (!record.pair.first->normalizedPrefix(&record.prefix)) {
+            return false;
+        }
+        for (int pass = 0; pass < RADIX_PASSES; ++pass) {
+            ++counts[pass][(record.prefix >> (pass * RADIX_BITS)) & ((1 << RADIX_BITS) - 1)];
+        }
+    }
+
+    std::vector<PrefixedPair> buffer(pairCount);
+    for (int pass = 0; pass < RADIX_PASSES; ++pass) {
+        std::vector<size_t> &offsets = counts[pass];
+        int shift = pass * RADIX_BITS;
+        if (offsets[(firstPrefix >> shift) & ((1 << RADIX_BITS) - 1)] == pairCount) {
+            continue;
+        }
+        size_t offset = 0;
+        for (size_t &count : offsets) {
+            size_t digitCount = count;
+            count = offset;
+            offset += digitCount;
+        }
+        for (const PrefixedPair &record : records) {
+            buffer[offsets[(record.prefix >> shift) & ((1 << RADIX_BITS) - 1)]++] = record;
+        }
+        records.swap(buffer);
+    }
+
+    bool exact = pairs.front().first->prefixIsExact();
+    for (size_t begin = 0, end; begin < pairCount; begin = end) {
+        end = begin + 1;
+        while (end < pairCount && records[end].prefix == records[begin].prefix) {
+            ++end;
+        }
+        if (!exact && end - begin > 1) {
+            std::sort(records.begin() + begin, records.begin() + end, prefixedPairHasSmallerKey);
+        }
+        for (size_t i = begin; i < end; ++i) {
+            pairs[i] = records[i].pair;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sorts intermediate pairs based on keys, with a radix sort when the keys have a normalized prefix
+ * @param pairs - the pairs to sort, usually the intermediate vector of a thread
  */
-void sortIntermediatePairsByKeys(ThreadContext *threadCtx) {
-    std::sort(threadCtx->intermediateVec.begin(),
-              threadCtx->intermediateVec.end(),
+void sortIntermediatePairsByKeys(IntermediateVec &pairs) {
+    if (pairs.size() >= RADIX_SORT_MIN_PAIRS && radixSortPairs(pairs)) {
+        return;
+    }
+    std::sort(pairs.begin(),
+              pairs.end(),
               [](const IntermediatePair &a, const IntermediatePair &b) {
                   return *(a.first) < *(b.first);
               });
@@ -465,71 +2679,144 @@ void sortIntermediatePairsByKeys(ThreadContext *threadCtx) {
 
 
 /**
- * Waits for the job to complete based on the specified waitFlag.
- *
- * The behavior of this function is determined by the waitFlag in the job:
- * - 0: Waits for all threads associated with the job to complete (joins all thread handles).
- * - 1: Waits for a specific already waiting thread.
- * - 2: The job has already finished, so no waiting is necessary.
- *
+ * Waits until the last slot of the job finished, may be called by several threads and more than once.
  * @param job A JobHandle that holds all the information related to this job.
  */
 void waitForJob(JobHandle job) {
     JobContext *curJob = ((JobContext *) job);
-    if (curJob->waitFlag == 2) {
-        return;
-    }
     if (pthread_mutex_lock(&curJob->waitMutex) != 0) {
-        fprintf(stdout, "system error: Failed to lock stage mutex at shuffle initialization.\n");
+        fprintf(stdout, "system error: on pthread_mutex_lock.\n");
         exit(EXIT_FAILURE);
     }
-    if (curJob->waitFlag == 0) {
-        waitFirstThread(curJob);
-    }
-    if (curJob->waitFlag == 1) {
-        if (pthread_cond_wait(&curJob->conditionVar, &curJob->barrierMutex) != 0) {
-            fprintf(stderr, "system error: on pthread_cond_wait.\n");
+    while (!curJob->finished) {
+        if (pthread_cond_wait(&curJob->conditionVar, &curJob->waitMutex) != 0) {
+            fprintf(stdout, "system error: on pthread_cond_wait.\n");
             exit(EXIT_FAILURE);
         }
     }
-}
-
-
-/**
- * Waits for all threads associated with the job to complete and updates the waitFlag accordingly.
- * @param curJob A pointer to the JobContext structure representing the current job.
- */
-void waitFirstThread(JobContext *curJob) {
-    curJob->waitFlag = 1;
     if (pthread_mutex_unlock(&curJob->waitMutex) != 0) {
-        fprintf(stdout, "system error: Failed to unlock stage mutex after shuffle setup.\n");
-        exit(EXIT_FAILURE);
-    }
-    for (int i = 0; i < curJob->multiThreadLevel; i++) {
-        pthread_join(curJob->threadHandles[i], NULL);
-    }
-    if (pthread_cond_broadcast(&curJob->conditionVar) != 0) {
-        fprintf(stdout, "system error: on pthread_cond_broadcast.\n");
+        fprintf(stdout, "system error: on pthread_mutex_unlock.\n");
         exit(EXIT_FAILURE);
     }
-    curJob->waitFlag = 2;
 }
 
 /**
  * Retrieve the JobState from the struct JobContext.
+ * Wait-free: the stage and its counts are read with one load of the progress word.
  * @param job - struct that holds all the information in this job.
  * @param state - JobState to insert the job state.
  */
 void getJobState(JobHandle job, JobState *state) {
     auto *curJob = (JobContext *) job;
-    if (pthread_mutex_lock(&curJob->stageMutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex_lock.\n");
-        exit(EXIT_FAILURE);
+    uint64_t progress = curJob->counterAtomic->load(std::memory_order_relaxed);
+    unsigned long processedItems = (progress >> PROCESSED_SHIFT) & INDEX_MASK;
+    unsigned long totalItems = progress & INDEX_MASK;
+    state->stage = static_cast<stage_t>(progress >> STAGE_SHIFT);
+    // processed can pass the total when an input source gave a size hint below its real size
+    state->percentage = totalItems == 0 ? 100.0f :
+                        std::min(static_cast<float>(processedItems) / static_cast<float>(totalItems) * 100.0f,
+                                 100.0f);
+}
+
+/**
+ * Waits for the job and moves the output of every thread into chunks, one chunk per thread that
+ * produced output. Only meaningful for jobs started with mergeOutput turned off.
+ * @param job - struct that holds all the information in this job.
+ * @param chunks - vector that receives the output chunks.
+ */
+void getOutputChunks(JobHandle job, std::vector<OutputVec> *chunks) {
+    waitForJob(job);
+    auto *curJob = (JobContext *) job;
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        OutputVec &threadOutput = curJob->threadContexts[i].outputVec;
+        if (!threadOutput.empty()) {
+            chunks->push_back(OutputVec());
+            chunks->back().swap(threadOutput);
+        }
     }
-    *state = curJob->jobState;
-    if (pthread_mutex_unlock(&curJob->stageMutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex_unlock.\n");
-        exit(EXIT_FAILURE);
+}
+
+/**
+ * Collects the statistics of the job, may be called while the job runs.
+ * @param job - struct that holds all the information in this job.
+ * @param stats - JobStats to fill.
+ */
+void getJobStats(JobHandle job, JobStats *stats) {
+    auto *curJob = (JobContext *) job;
+    *stats = JobStats();
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        const ThreadContext &threadContext = curJob->threadContexts[i];
+        stats->emittedPairs += threadContext.emittedPairs.load(std::memory_order_relaxed);
+        stats->combinerInputPairs += threadContext.combinerInputPairs.load(std::memory_order_relaxed);
+        stats->combinerOutputPairs += threadContext.combinerOutputPairs.load(std::memory_order_relaxed);
+        stats->arenaAllocations += threadContext.arenaAllocations.load(std::memory_order_relaxed);
+        stats->arenaBytes += threadContext.arenaBytes.load(std::memory_order_relaxed);
+        stats->arenaBlockBytes += threadContext.arenaBlockBytes.load(std::memory_order_relaxed);
+        stats->spilledPairs += threadContext.spilledPairs.load(std::memory_order_relaxed);
+        stats->spillRuns += threadContext.spillRunCount.load(std::memory_order_relaxed);
+        stats->spillMerges += threadContext.spillMergeCount.load(std::memory_order_relaxed);
+    }
+    stats->shuffledPairs = curJob->shufflePairCount.load(std::memory_order_relaxed);
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        stats->partialMerges += curJob->threadContexts[i].partialMerges.load(std::memory_order_relaxed);
+    }
+    stats->threads.resize(curJob->multiThreadLevel);
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        const ThreadContext &threadContext = curJob->threadContexts[i];
+        ThreadStats &threadStats = stats->threads[i];
+        PhaseTimes *phases[] = {&threadStats.map, &threadStats.shuffle, &threadStats.reduce};
+        for (int phase = MAP_PHASE; phase <= REDUCE_PHASE; ++phase) {
+            phases[phase]->wallNanos = threadContext.phaseWallNanos[phase].load(std::memory_order_relaxed);
+            phases[phase]->cpuNanos = threadContext.phaseCpuNanos[phase].load(std::memory_order_relaxed);
+        }
+        threadStats.sortNanos = threadContext.sortNanos.load(std::memory_order_relaxed);
+        threadStats.barrierWaitNanos = threadContext.barrierWaitNanos.load(std::memory_order_relaxed);
+        threadStats.lockWaitNanos = threadContext.lockWaitNanos.load(std::memory_order_relaxed);
+        threadStats.emittedPairs = threadContext.emittedPairs.load(std::memory_order_relaxed);
+        threadStats.reducedGroups = threadContext.reducedGroups.load(std::memory_order_relaxed);
+    }
+    // set by the last slot to finish mapping, read only once reduce started
+    if (static_cast<stage_t>(curJob->counterAtomic->load() >> STAGE_SHIFT) == REDUCE_STAGE) {
+        stats->largestGroupPairs = curJob->largestGroupPairs;
+        stats->splitGroups = curJob->splitGroups.size();
+        stats->groupParts = curJob->groupParts.size();
+    }
+}
+
+/**
+ * Writes the trace rings of a finished job as a Chrome trace: one complete event ("ph": "X") per span,
+ * with times in microseconds since the job started and one trace thread per job thread. The trace is
+ * only a diagnostic, so a file that cannot be written is reported and skipped and the job closes as usual.
+ * @param jobContext - the finished job.
+ */
+void writeTrace(JobContext *jobContext) {
+    FILE *file = fopen(jobContext->options.tracePath, "w");
+    if (file == nullptr) {
+        fprintf(stdout, "system error: Unable to open the trace file, the trace is skipped.\n");
+        return;
+    }
+    int pid = static_cast<int>(getpid());
+    unsigned long capacity = jobContext->options.traceEvents;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    const char *separator = "\n";
+    for (int i = 0; i < jobContext->multiThreadLevel; ++i) {
+        const ThreadContext &threadContext = jobContext->threadContexts[i];
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                      "\"args\":{\"name\":\"thread %d\"}}", separator, pid, i, i);
+        separator = ",\n";
+        // the oldest event kept is the one the next event would overwrite
+        unsigned long first = threadContext.traceCount > capacity ? threadContext.traceCount - capacity : 0;
+        for (unsigned long n = first; n < threadContext.traceCount; ++n) {
+            const TraceEvent &event = threadContext.traceEvents[n % capacity];
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"mapreduce\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"pid\":%d,\"tid\":%d,\"args\":{\"items\":%lu}}",
+                    event.name, (event.start - jobContext->traceOrigin) / 1e3, (event.end - event.start) / 1e3,
+                    pid, i, event.items);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    if (fclose(file) != 0) {
+        fprintf(stdout, "system error: Unable to write the trace file, the trace may be incomplete.\n");
     }
 }
 
@@ -539,29 +2826,359 @@ void getJobState(JobHandle job, JobState *state) {
 void closeJobHandle(JobHandle job) {
     waitForJob(job);
     JobContext *curJob = ((JobContext *) job);
+    if (curJob->options.tracePath != nullptr) {
+        writeTrace(curJob);
+    }
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        delete[] curJob->threadContexts[i].traceEvents;
+    }
+    if (curJob->phases != nullptr) {
+        curJob->phases->destroy(curJob->phases->arg);
+        delete curJob->phases;
+    }
     delete curJob->counterAtomic;
     delete curJob->barrier;
-    delete[] curJob->threadHandles;
+    for (int i = 0; i < curJob->multiThreadLevel; ++i) {
+        if (pthread_mutex_destroy(&curJob->threadContexts[i].tasks.mutex) != 0) {
+            fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
     delete[] curJob->threadContexts;
-    if (pthread_mutex_destroy(&curJob->counterMutex) != 0) {
+    if (pthread_cond_destroy(&curJob->conditionVar) != 0) {
         fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&curJob->stageMutex) != 0) {
+    if (pthread_mutex_destroy(&curJob->waitMutex) != 0 || pthread_mutex_destroy(&curJob->pipelineMutex) != 0) {
         fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
         exit(EXIT_FAILURE);
     }
-    if (pthread_cond_destroy(&curJob->conditionVar) != 0) {
+    delete curJob;
+}
+
+
+/**
+ * @param next - returns the next input pair, or false once the input ran out.
+ * @param state - passed to next and release.
+ * @param release - frees a pair once it was mapped, nullptr to keep the pairs.
+ */
+GeneratorInputSource::GeneratorInputSource(Generator next, void *state, Release release)
+        : next(next), state(state), release(release), exhausted(false), mutex(PTHREAD_MUTEX_INITIALIZER) {}
+
+GeneratorInputSource::~GeneratorInputSource() {
+    if (pthread_mutex_destroy(&mutex) != 0) {
         fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&curJob->vectorMutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+}
+
+/**
+ * Calls the generator up to maxPairs times under the mutex of the source.
+ * @param split - the empty split to fill.
+ * @param maxPairs - the most pairs to add.
+ * @return false once the generator ran out and the split is empty.
+ */
+bool GeneratorInputSource::nextSplit(InputVec &split, size_t maxPairs) {
+    if (lockCounted(&mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock input source mutex.\n");
         exit(EXIT_FAILURE);
     }
-    if (pthread_mutex_destroy(&curJob->barrierMutex) != 0) {
-        fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+    while (!exhausted && split.size() < maxPairs) {
+        InputPair pair(nullptr, nullptr);
+        if (!next(state, &pair.first, &pair.second)) {
+            exhausted = true;
+        } else {
+            split.push_back(pair);
+        }
+    }
+    if (pthread_mutex_unlock(&mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock input source mutex.\n");
         exit(EXIT_FAILURE);
     }
-    delete curJob;
+    return !split.empty();
+}
+
+/**
+ * Passes every pair of a mapped split to the release function.
+ * @param split - the mapped split.
+ */
+void GeneratorInputSource::releaseSplit(InputVec &split) {
+    if (release == nullptr) {
+        return;
+    }
+    for (const InputPair &pair : split) {
+        release(state, pair.first, pair.second);
+    }
+}
+
+
+void lockChannel(StageChannel *channel) {
+    if (lockCounted(&channel->mutex) != 0) {
+        fprintf(stdout, "system error: Unable to lock stage channel mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void unlockChannel(StageChannel *channel) {
+    if (pthread_mutex_unlock(&channel->mutex) != 0) {
+        fprintf(stdout, "system error: Unable to unlock stage channel mutex.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Adds to the processed and total counts of the progress word of a JobGraph consumer. The counts grow
+ * with every published split and have no bound, so both saturate at INDEX_MASK instead of carrying into
+ * the stage bits. A saturated total keeps the placeholder pair, the processed count catches up with it.
+ * @param jobContext - the consumer job.
+ * @param processedItems - items the consumer mapped.
+ * @param addedItems - items added to the total, -1 to take back the placeholder pair.
+ */
+void addChannelProgress(JobContext *jobContext, unsigned long processedItems, long addedItems) {
+    std::atomic<uint64_t> *counter = jobContext->counterAtomic;
+    uint64_t progress = counter->load(std::memory_order_relaxed);
+    uint64_t updated;
+    do {
+        unsigned long processed = (progress >> PROCESSED_SHIFT) & INDEX_MASK;
+        unsigned long total = progress & INDEX_MASK;
+        processed = std::min(processed + processedItems, INDEX_MASK);
+        if (addedItems >= 0) {
+            total = std::min(total + static_cast<unsigned long>(addedItems), INDEX_MASK);
+        } else if (total != INDEX_MASK) {
+            total -= static_cast<unsigned long>(-addedItems);
+        }
+        updated = packProgress(static_cast<stage_t>(progress >> STAGE_SHIFT), processed, total);
+    } while (!counter->compare_exchange_weak(progress, updated, std::memory_order_relaxed));
+}
+
+/**
+ * Publishes a split to every consumer of a stage and queues one parked slot of each to map it. The map
+ * total of every consumer grows by the pairs of the split, so its progress follows what was handed over.
+ * @param channels - the channels of the consumers.
+ * @param pairs - the output pairs to publish, left empty.
+ */
+void publishSplit(const std::vector<StageChannel *> &channels, OutputVec &pairs) {
+    auto *split = new SharedSplit;
+    split->pairs.swap(pairs);
+    split->readers = static_cast<int>(channels.size());
+    for (StageChannel *channel : channels) {
+        std::vector<ThreadContext *> woken;
+        lockChannel(channel);
+        channel->readySplits.push_back(split);
+        addChannelProgress(channel->consumer, 0, static_cast<long>(split->pairs.size()));
+        if (!channel->parkedSlots.empty()) {
+            woken.push_back(channel->parkedSlots.back());
+            channel->parkedSlots.pop_back();
+        }
+        unlockChannel(channel);
+        wakeSlots(woken);
+    }
+}
+
+/**
+ * The output sink of a JobGraph stage whose output other stages consume, publishes the output pairs to
+ * the channels of all its consumers.
+ */
+class ChannelWriter : public OutputSink {
+public:
+    ChannelWriter() : splitPairs(0) {}
+
+    // adds a consumer, splits are as small as the smallest split a consumer asks for
+    void addChannel(StageChannel *channel) {
+        channels.push_back(channel);
+        splitPairs = splitPairs == 0 ? channel->splitPairs : std::min(splitPairs, channel->splitPairs);
+    }
+
+    void open(int threadCount) override {
+        splits.resize(threadCount);
+    }
+
+    void write(int threadId, K3 *key, V3 *value) override {
+        OutputVec &split = splits[threadId].pairs;
+        split.push_back(OutputPair(key, value));
+        if (split.size() >= splitPairs) {
+            publishSplit(channels, split);
+        }
+    }
+
+    void flush(int threadId) override {
+        if (!splits[threadId].pairs.empty()) {
+            publishSplit(channels, splits[threadId].pairs);
+        }
+    }
+
+    // the last producer of a consumer to close wakes all its parked slots, they find the channel drained
+    // or map the rest, and takes back the pair a consumer map total starts with
+    void close() override {
+        for (StageChannel *channel : channels) {
+            std::vector<ThreadContext *> woken;
+            lockChannel(channel);
+            if (--channel->openProducers == 0) {
+                woken.swap(channel->parkedSlots);
+                addChannelProgress(channel->consumer, 0, -1);
+            }
+            unlockChannel(channel);
+            wakeSlots(woken);
+        }
+    }
+
+private:
+    struct ThreadSplit {
+        OutputVec pairs;
+        // keeps the split of the next thread off this cache line, write runs without a lock
+        char cacheLinePadding[64];
+    };
+
+    std::vector<StageChannel *> channels;
+    unsigned long splitPairs;
+    std::vector<ThreadSplit> splits;
+};
+
+/**
+ * A stage of a JobGraph, turned into a job by start.
+ */
+struct JobGraph::Stage {
+    Stage(const MapReduceClient *client, const InputVec *inputVec, StageChannel *inputChannel,
+          int multiThreadLevel, const JobOptions &options)
+            : client(client), inputVec(inputVec), inputChannel(inputChannel), outputWriter(nullptr),
+              multiThreadLevel(multiThreadLevel), options(options), job(nullptr) {}
+
+    const MapReduceClient *client;
+    // the input of a stage without producers
+    const InputVec *inputVec;
+    // the input of a stage with producers, nullptr otherwise
+    StageChannel *inputChannel;
+    // set once other stages consume the output
+    ChannelWriter *outputWriter;
+    int multiThreadLevel;
+    JobOptions options;
+    OutputVec outputVec;
+    JobContext *job;
+};
+
+JobGraph::JobGraph() : started(false) {}
+
+JobGraph::~JobGraph() {
+    for (Stage *stage : stages) {
+        if (stage->job != nullptr) {
+            closeJobHandle(stage->job);
+        }
+    }
+    for (Stage *stage : stages) {
+        delete stage->outputWriter;
+        if (stage->inputChannel != nullptr) {
+            if (pthread_mutex_destroy(&stage->inputChannel->mutex) != 0) {
+                fprintf(stdout, "system error: on pthread_mutex/cond_destroy.\n");
+                exit(EXIT_FAILURE);
+            }
+            delete stage->inputChannel;
+        }
+        delete stage;
+    }
+}
+
+/**
+ * Adds a stage that maps an input vector.
+ * @param client - the client of the stage, must outlive the graph.
+ * @param inputVec - the input pairs, must outlive the stage.
+ * @param multiThreadLevel - the number of slots of the stage.
+ * @param options - the job options of the stage.
+ * @return the id of the stage.
+ */
+int JobGraph::addStage(const MapReduceClient &client, const InputVec &inputVec,
+                       int multiThreadLevel, const JobOptions &options) {
+    stages.push_back(new Stage(&client, &inputVec, nullptr, multiThreadLevel, options));
+    return static_cast<int>(stages.size()) - 1;
+}
+
+/**
+ * Adds a stage that maps the output of earlier stages. Producers must be added first, so the stages
+ * always form a DAG. A producer may feed several stages, each of them maps all its output pairs.
+ * @param client - the client of the stage, must outlive the graph.
+ * @param producers - ids of distinct earlier stages whose output the stage maps.
+ * @param handoff - turns an output pair of a producer into an input pair of the stage.
+ * @param release - frees a pair once it was mapped, nullptr to keep the pairs.
+ * @param multiThreadLevel - the number of slots of the stage.
+ * @param options - the job options of the stage.
+ * @return the id of the stage.
+ */
+int JobGraph::addStage(const MapReduceClient &client, const std::vector<int> &producers,
+                       Handoff handoff, Release release, int multiThreadLevel, const JobOptions &options) {
+    auto *channel = new StageChannel;
+    channel->mutex = PTHREAD_MUTEX_INITIALIZER;
+    channel->openProducers = static_cast<int>(producers.size());
+    channel->splitPairs = options.taskGrain == 0 ? SOURCE_SPLIT_PAIRS : options.taskGrain;
+    channel->handoff = handoff;
+    channel->release = release;
+    channel->consumer = nullptr;
+    for (size_t i = 0; i < producers.size(); ++i) {
+        int producer = producers[i];
+        if (producer < 0 || producer >= static_cast<int>(stages.size())
+            || std::find(producers.begin(), producers.begin() + i, producer) != producers.begin() + i) {
+            fprintf(stdout, "system error: stage %d is not a distinct earlier stage.\n", producer);
+            exit(EXIT_FAILURE);
+        }
+        if (stages[producer]->outputWriter == nullptr) {
+            stages[producer]->outputWriter = new ChannelWriter();
+        }
+        stages[producer]->outputWriter->addChannel(channel);
+    }
+    stages.push_back(new Stage(&client, nullptr, channel, multiThreadLevel, options));
+    return static_cast<int>(stages.size()) - 1;
+}
+
+/**
+ * Starts every stage. The jobs are all created before the first one runs, so no producer can publish
+ * a split before its consumer exists.
+ */
+void JobGraph::start() {
+    if (started) {
+        return;
+    }
+    started = true;
+    for (Stage *stage : stages) {
+        JobOptions options = stage->options;
+        if (stage->outputWriter != nullptr) {
+            options.outputSink = stage->outputWriter;
+        }
+        stage->job = newJobContext(stage->client, stage->inputVec, &stage->outputVec,
+                                   stage->multiThreadLevel, options);
+        if (stage->inputChannel != nullptr) {
+            stage->job->inputChannel = stage->inputChannel;
+            stage->inputChannel->consumer = stage->job;
+            // the map total is the pairs published so far, plus one until the last producer closed so the
+            // stage does not show 100% while its producers still reduce
+            stage->job->counterAtomic->store(packProgress(MAP_STAGE, 0, 1));
+        }
+    }
+    for (Stage *stage : stages) {
+        submitJob(stage->job);
+    }
+}
+
+/**
+ * Waits for every stage of a started graph.
+ */
+void JobGraph::wait() {
+    for (Stage *stage : stages) {
+        if (stage->job != nullptr) {
+            waitForJob(stage->job);
+        }
+    }
+}
+
+/**
+ * @param stage - the id of a stage.
+ * @return the job of the stage, nullptr before start.
+ */
+JobHandle JobGraph::stageJob(int stage) const {
+    return stages[stage]->job;
+}
+
+/**
+ * @param stage - the id of a stage.
+ * @return the output vector of the stage, empty when other stages consume its output.
+ */
+OutputVec &JobGraph::getOutput(int stage) {
+    return stages[stage]->outputVec;
 }
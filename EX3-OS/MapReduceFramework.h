@@ -2,6 +2,9 @@
 #define MAPREDUCEFRAMEWORK_H
 
 #include "MapReduceClient.h"
+#include <new>     //placement new
+#include <utility> //std::forward
+#include <pthread.h>
 
 typedef void* JobHandle;
 
@@ -12,15 +15,236 @@ typedef struct {
 	float percentage;
 } JobState;
 
+enum shuffle_mode_t {SERIAL_SHUFFLE=0, PARALLEL_SHUFFLE=1, HASH_SHUFFLE=2};
+
+// optional settings of a job, the defaults give the behaviour of the four argument startMapReduceJob
+struct JobOptions {
+	// when false the output of every thread is kept in its own chunk instead of being
+	// spliced into outputVec, the chunks are collected with getOutputChunks
+	bool mergeOutput = true;
+	// SERIAL_SHUFFLE merges all keys on the last thread to finish mapping, PARALLEL_SHUFFLE
+	// splits the keys into sampled ranges that every thread merges on its own, HASH_SHUFFLE
+	// skips sorting and groups keys by HashedK2::hash and HashedK2::operator== (groups are not ordered),
+	// the intermediate keys must derive from HashedK2
+	shuffle_mode_t shuffleMode = PARALLEL_SHUFFLE;
+	// number of pairs a thread holds before the client combiner runs during map
+	unsigned long combineThreshold = 65536;
+	// number of input pairs or reduce groups a thread takes from its queue at once, 0 picks the
+	// grain adaptively
+	unsigned long taskGrain = 0;
+	// when a thread runs out of work it steals from the queues of the other threads
+	bool workStealing = true;
+	// share of the pool workers the job gets while other jobs run, relative to their weights
+	unsigned int weight = 1;
+	// intermediate pairs the job may hold in memory (split evenly between its threads), 0 for
+	// no limit. Above it a thread sorts its pairs and writes them to a temporary file with the
+	// serializer, and reduce streams a merge of all the runs. A thread with too many runs open
+	// merges its smallest runs into one file, reading the pairs back with the serializer and
+	// releasing them again. Needs a serializer, and is not used with HASH_SHUFFLE. Spilled pairs are freed with IntermediateSerializer::release, but
+	// keys and values from allocateIntermediate are not: the arena of a thread is freed after each
+	// of its spills instead, so its memory stays within the budget too. Map and combine must then
+	// not keep pointers to arena memory from one call to the next.
+	unsigned long memoryBudget = 0;
+	const IntermediateSerializer* serializer = nullptr;
+	// when set, emit3 writes the output pairs to the sink as they are produced and outputVec
+	// stays empty. The sink must outlive the job.
+	OutputSink* outputSink = nullptr;
+	// threads that finish mapping while others still map merge their sorted runs in pairs with the
+	// runs of other finished threads (runs merged from as many runs, like a binary counter), and
+	// reduce pulls batches of groups from a merge of the few runs left as soon as the last thread
+	// finished mapping, without a shuffle stage. Not used with HASH_SHUFFLE.
+	bool pipelined = false;
+	// groups with more pairs are reduced in parts by several threads when the client can merge
+	// partial results, 0 picks the shuffled pairs / (2 * multiThreadLevel). Not used when reduce
+	// streams a merge (spilled or pipelined jobs).
+	unsigned long splitGroupPairs = 0;
+	// reduce groups are queued longest processing time first by MapReduceClient::reduceCost (the
+	// group size by default) instead of in key order, so a huge group does not start last. Not
+	// used when reduce streams a merge.
+	bool largestGroupsFirst = false;
+	// when set, every thread records its phases, the task ranges it claims, shuffle merges, spills
+	// and barrier waits in a ring buffer of traceEvents events, and closeJobHandle writes them to
+	// this file as a Chrome trace (chrome://tracing or ui.perfetto.dev). A file that cannot be written
+	// is reported and skipped. A thread keeps its latest events once its buffer is full. Off by
+	// default, which costs one check per event.
+	const char* tracePath = nullptr;
+	unsigned long traceEvents = 16384;
+};
+
+// time one job thread ran on a pool worker in a phase, and the CPU time it used meanwhile
+struct PhaseTimes {
+	unsigned long wallNanos = 0;
+	unsigned long cpuNanos = 0;
+};
+
+// the breakdown of one job thread, see JobStats::threads
+struct ThreadStats {
+	PhaseTimes map;                      // map, combine, spill and sort
+	PhaseTimes shuffle;                  // shuffle, and the work the last thread to reach a barrier
+	                                     // does for all threads (e.g. the serial shuffle)
+	PhaseTimes reduce;
+	unsigned long sortNanos = 0;         // part of map spent sorting the intermediate pairs
+	unsigned long barrierWaitNanos = 0;  // from reaching the job barrier until running again
+	unsigned long lockWaitNanos = 0;     // blocked on framework mutexes
+	unsigned long emittedPairs = 0;      // pairs emitted by map
+	unsigned long reducedGroups = 0;     // reduce calls, a part of a split group counts as one
+};
+
+// statistics of a job, see getJobStats
+struct JobStats {
+	unsigned long emittedPairs = 0;        // pairs emitted by map
+	unsigned long combinerInputPairs = 0;  // pairs passed through the combiner
+	unsigned long combinerOutputPairs = 0; // pairs the combiner emitted back
+	unsigned long shuffledPairs = 0;       // pairs left for the shuffle, 0 until it starts
+	unsigned long arenaAllocations = 0;    // allocateIntermediate calls
+	unsigned long arenaBytes = 0;          // bytes handed out by allocateIntermediate
+	unsigned long arenaBlockBytes = 0;     // bytes of the arena blocks behind them
+	unsigned long spilledPairs = 0;        // pairs written to spill files
+	unsigned long spillRuns = 0;           // sorted runs written to spill files
+	unsigned long spillMerges = 0;         // merges of spill runs that kept the open spill files bounded
+	unsigned long largestGroupPairs = 0;   // pairs of the largest reduce group, 0 until reduce starts
+	unsigned long splitGroups = 0;         // groups reduced in parts
+	unsigned long groupParts = 0;          // parts of those groups
+	unsigned long partialMerges = 0;       // mergePartials calls
+	std::vector<ThreadStats> threads;      // one per job thread, the times so far while the job runs
+};
+
+// the jobs run on one pool of worker threads shared by all jobs. Without initWorkerPool the pool
+// is started by the first job and grows to the largest multiThreadLevel requested.
+void initWorkerPool(int workerCount);
+// waits for the jobs already started, then stops the workers. A job started while the pool shuts
+// down waits for the shutdown and runs on a new pool, so it must not be started from map or reduce.
+void shutdownWorkerPool();
+
+// the phases of a job that keeps its own pairs, used by the typed jobs of MapReduceJob.h. Every slot
+// calls map(arg, slot, context) until it returns true, then the last slot to finish mapping calls
+// shuffle(arg), which returns the number of items reduce processes, then every slot calls
+// reduce(arg, slot, context) until it returns true, and the last slot to finish reducing calls
+// finish(arg). map and reduce return false to give the worker to another job when jobShouldYield
+// says so, and are called again to go on. closeJobHandle calls destroy(arg).
+struct JobPhases {
+	void* arg;
+	bool (*map)(void* arg, int slot, void* context);
+	unsigned long (*shuffle)(void* arg);
+	bool (*reduce)(void* arg, int slot, void* context);
+	void (*finish)(void* arg);
+	void (*destroy)(void* arg);
+};
+
+// starts a job of phases whose map stage processes inputSize items. The handle works with
+// waitForJob, getJobState, getJobStats and closeJobHandle, of the options only weight, tracePath
+// and traceEvents apply.
+JobHandle startPhasedJob(const JobPhases& phases, unsigned long inputSize, int multiThreadLevel,
+	const JobOptions& options = JobOptions());
+// from map or reduce of the phases: counts items of the current stage as processed
+void addJobProgress(void* context, unsigned long items);
+// from map or reduce of the phases: true once the slot used its time slice while another job waits
+bool jobShouldYield(void* context);
+
 void emit2 (K2* key, V2* value, void* context);
 void emit3 (K3* key, V3* value, void* context);
 
+// allocates memory for a K2 or V2 from a bump arena of the calling thread, from
+// map and combine only (context is the one they got). All the arena memory of
+// a job is released at once after its last reduce call (or of a thread after it
+// spilled, see JobOptions::memoryBudget): objects in it are not destroyed and
+// must not be deleted, and nothing may point into it afterwards.
+void* allocateIntermediate(size_t size, void* context);
+
+// constructs a T in the arena, e.g. emit2(arenaNew<KChar>(context, c), ...)
+template <typename T, typename... Args>
+T* arenaNew(void* context, Args&&... args) {
+	return new (allocateIntermediate(sizeof(T), context)) T(std::forward<Args>(args)...);
+}
+
 JobHandle startMapReduceJob(const MapReduceClient& client,
 	const InputVec& inputVec, OutputVec& outputVec,
 	int multiThreadLevel);
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	const InputVec& inputVec, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options);
+// maps the pairs of inputSource, which must outlive the job. Every thread pulls
+// JobOptions::taskGrain pairs at once (256 with an adaptive grain), so only the
+// splits being mapped are held in memory.
+JobHandle startMapReduceJob(const MapReduceClient& client,
+	InputSource& inputSource, OutputVec& outputVec,
+	int multiThreadLevel, const JobOptions& options = JobOptions());
+
+// an InputSource over a generator function: next(state, &key, &value) sets the next
+// input pair and returns true, or returns false once the input ran out. Calls to next
+// are serialized. release (when not nullptr) frees every pair once it was mapped, it is
+// called from several threads at once.
+class GeneratorInputSource : public InputSource {
+public:
+	typedef bool (*Generator)(void* state, K1** key, V1** value);
+	typedef void (*Release)(void* state, K1* key, V1* value);
+
+	GeneratorInputSource(Generator next, void* state, Release release = nullptr);
+	virtual ~GeneratorInputSource();
+	virtual bool nextSplit(InputVec& split, size_t maxPairs);
+	virtual void releaseSplit(InputVec& split);
+
+private:
+	Generator next;
+	void* state;
+	Release release;
+	bool exhausted;
+	pthread_mutex_t mutex;
+};
+
+// a DAG of map-reduce stages in which the reduce output of a stage feeds the map
+// of the stage that consumes it in memory, with no OutputVec or InputVec between
+// them. The pairs are handed over in small splits as reduce emits them, so a
+// consumer maps while its producers still reduce and stages without a path
+// between them run side by side on the worker pool. A consumer slot that finds
+// no split waits off the workers until one is published. A stage may feed
+// several consumers, each of them maps every output pair of the stage; the
+// consumers then own the pairs together.
+class JobGraph {
+public:
+	// turns an output pair of a producer into an input pair of its consumer,
+	// e.g. with a static_cast when the client classes derive from K3 and K1.
+	// Called once per consumer of the producer, so it must leave the pair as it is
+	typedef void (*Handoff)(K3* key, V3* value, K1** inputKey, V1** inputValue);
+	// frees a handed over pair once every consumer of its producer mapped it,
+	// called by the last of them with its own Release
+	typedef void (*Release)(K1* key, V1* value);
+
+	JobGraph();
+	// waits for the stages and closes their jobs
+	~JobGraph();
+	JobGraph(const JobGraph&) = delete;
+	JobGraph& operator=(const JobGraph&) = delete;
+
+	// adds a stage that maps inputVec and returns its id
+	int addStage(const MapReduceClient& client, const InputVec& inputVec,
+		int multiThreadLevel, const JobOptions& options = JobOptions());
+	// adds a stage that maps the output of the earlier stages producers and
+	// returns its id. The producers write to their consumers instead of their
+	// JobOptions::outputSink. release may be nullptr to keep the pairs. The map
+	// progress of the stage counts the pairs its producers handed over so far.
+	int addStage(const MapReduceClient& client, const std::vector<int>& producers,
+		Handoff handoff, Release release, int multiThreadLevel,
+		const JobOptions& options = JobOptions());
+
+	// starts all the stages, once
+	void start();
+	void wait();
+	// the job of a started stage, for getJobState and getJobStats
+	JobHandle stageJob(int stage) const;
+	// the output of a stage no other stage consumes, complete after wait
+	OutputVec& getOutput(int stage);
+
+private:
+	struct Stage;
+	std::vector<Stage*> stages;
+	bool started;
+};
 
 void waitForJob(JobHandle job);
 void getJobState(JobHandle job, JobState* state);
+void getJobStats(JobHandle job, JobStats* stats);
+void getOutputChunks(JobHandle job, std::vector<OutputVec>* chunks);
 void closeJobHandle(JobHandle job);
 	
 	
@@ -0,0 +1,256 @@
+#ifndef MAPREDUCEJOB_H
+#define MAPREDUCEJOB_H
+
+#include "MapReduceFramework.h"
+#include "ShuffleMerge.h"
+#include <vector>     //std::vector
+#include <utility>    //std::pair, std::move
+#include <algorithm>  //std::sort
+#include <functional> //std::less
+#include <atomic>     //std::atomic
+#include <iterator>   //std::make_move_iterator
+#include <type_traits> //std::is_same
+
+// a statically typed map-reduce job. Keys and values are stored by value in
+// contiguous vectors and compared with Compare, which the compiler inlines,
+// so no pair is heap allocated and no comparison is a virtual call.
+//
+// the client is any class with the two functions:
+//   void map(const K1& key, const V1& value, MapEmitter& emitter) const;
+//   void reduce(const K2& key, const V2* begin, const V2* end,
+//               ReduceEmitter& emitter) const;
+// map calls emitter.emit(K2, V2) and reduce calls emitter.emit(K3, V3) any
+// number of times. reduce gets all the values of one key, in one array, so V2
+// cannot be bool (std::vector<bool> has no array to point into): use char.
+//
+// the job is a phased job of MapReduceFramework (see startPhasedJob) with
+// multiThreadLevel slots: map and sort, then merge and reduce of one key range
+// per slot, with the sampling and merge of ShuffleMerge.h. It shares the worker
+// pool with the other jobs by its weight, yields like them, and reports its
+// progress, stats and trace through its job handle. The output is ordered by K2.
+template <typename K1, typename V1, typename K2, typename V2,
+		typename K3, typename V3, typename Compare = std::less<K2>>
+class MapReduceJob {
+	static_assert(!std::is_same<V2, bool>::value,
+			"MapReduceJob passes the values of a key to reduce as one array, which std::vector<bool> "
+			"cannot give; use char for V2");
+
+public:
+	typedef std::vector<std::pair<K1, V1>> InputVec;
+	typedef std::vector<std::pair<K3, V3>> OutputVec;
+
+	class MapEmitter {
+	public:
+		void emit(K2 key, V2 value) {
+			pairs.emplace_back(std::move(key), std::move(value));
+		}
+
+	private:
+		friend class MapReduceJob;
+		std::vector<std::pair<K2, V2>> pairs;
+	};
+
+	class ReduceEmitter {
+	public:
+		void emit(K3 key, V3 value) {
+			output.emplace_back(std::move(key), std::move(value));
+		}
+
+	private:
+		friend class MapReduceJob;
+		OutputVec output;
+	};
+
+	// starts the job and returns its handle, for waitForJob, getJobState,
+	// getJobStats and closeJobHandle. The output is appended to output once the
+	// job is done. client, input and output must outlive the job. Of the
+	// options only weight, tracePath and traceEvents apply.
+	template <typename Client>
+	static JobHandle start(const Client& client, const InputVec& input, OutputVec& output,
+			int multiThreadLevel, const JobOptions& options = JobOptions()) {
+		Job<Client>* job = new Job<Client>(client, input, output, std::max(multiThreadLevel, 1));
+		JobPhases phases = {job, mapPhase<Client>, shufflePhase<Client>, reducePhase<Client>,
+				finishPhase<Client>, destroyJob<Client>};
+		return startPhasedJob(phases, input.size(), job->slotCount, options);
+	}
+
+	// runs the job and appends its output to output, returns once the job is done.
+	// must not be called from a map or reduce function.
+	template <typename Client>
+	static void run(const Client& client, const InputVec& input,
+			OutputVec& output, int multiThreadLevel) {
+		closeJobHandle(start(client, input, output, multiThreadLevel));
+	}
+
+private:
+	enum {
+		// a map slot claims this share of the input of one slot at once
+		GRAIN_DIVISOR = 16
+	};
+
+	typedef std::pair<K2, V2> Pair;
+	typedef std::pair<Pair*, Pair*> Run;
+
+	struct Slot {
+		Slot() : merged(false), nextGroup(0) {}
+
+		MapEmitter mapEmitter;
+		ReduceEmitter reduceEmitter;
+		std::vector<K2> samples;
+		// the part of the sorted pairs of every slot in the key range of this slot
+		std::vector<Run> rangeRuns;
+		// the merged key range: keys, values and the end of every group
+		std::vector<K2> keys;
+		std::vector<V2> values;
+		std::vector<size_t> groupEnds;
+		bool merged;
+		size_t nextGroup;
+		// keeps the vectors of the next slot off this cache line
+		char cacheLinePadding[64];
+	};
+
+	// moves every group of the merge into the keys and values of a slot. The
+	// key ranges are disjoint and were cut before, so the pairs can be moved out
+	struct RangeCollector {
+		Slot& slot;
+
+		void operator()(const std::vector<Run>& chunks) {
+			for (const Run& chunk : chunks) {
+				for (Pair* pair = chunk.first; pair != chunk.second; ++pair) {
+					slot.keys.push_back(std::move(pair->first));
+					slot.values.push_back(std::move(pair->second));
+				}
+			}
+			slot.groupEnds.push_back(slot.keys.size());
+		}
+	};
+
+	template <typename Client>
+	struct Job {
+		Job(const Client& client, const InputVec& input, OutputVec& output, int slotCount)
+				: client(client), input(input), output(output), slotCount(slotCount),
+				  slots(slotCount), nextInput(0),
+				  grain(std::max<size_t>(input.size() / (slotCount * static_cast<size_t>(GRAIN_DIVISOR)), 1)) {}
+
+		const Client& client;
+		const InputVec& input;
+		OutputVec& output;
+		int slotCount;
+		std::vector<Slot> slots;
+		std::atomic<size_t> nextInput;
+		size_t grain;
+		Compare less;
+	};
+
+	// maps input ranges until the input runs out or the slot should yield, then
+	// sorts and samples the pairs of the slot
+	template <typename Client>
+	static bool mapPhase(void* arg, int slotId, void* context) {
+		Job<Client>& job = *static_cast<Job<Client>*>(arg);
+		Slot& slot = job.slots[slotId];
+		size_t inputSize = job.input.size();
+		size_t begin;
+		while ((begin = job.nextInput.fetch_add(job.grain, std::memory_order_relaxed)) < inputSize) {
+			size_t end = std::min(begin + job.grain, inputSize);
+			for (size_t i = begin; i < end; ++i) {
+				job.client.map(job.input[i].first, job.input[i].second, slot.mapEmitter);
+			}
+			addJobProgress(context, end - begin);
+			if (jobShouldYield(context)) {
+				return false;
+			}
+		}
+
+		std::vector<Pair>& pairs = slot.mapEmitter.pairs;
+		const Compare& less = job.less;
+		std::sort(pairs.begin(), pairs.end(), [&less](const Pair& a, const Pair& b) {
+			return less(a.first, b.first);
+		});
+		sampleSortedRun(pairs, [](const Pair& pair) -> const K2& { return pair.first; }, slot.samples);
+		return true;
+	}
+
+	// cuts the sorted pairs of every slot into the key ranges of the slots with
+	// the samples of all slots. Done before reduce starts, since it moves the
+	// keys out of the pairs. Returns the number of pairs to reduce
+	template <typename Client>
+	static unsigned long shufflePhase(void* arg) {
+		Job<Client>& job = *static_cast<Job<Client>*>(arg);
+		std::vector<K2> samples;
+		for (Slot& slot : job.slots) {
+			samples.insert(samples.end(), slot.samples.begin(), slot.samples.end());
+			std::vector<K2>().swap(slot.samples);
+		}
+		std::sort(samples.begin(), samples.end(), job.less);
+		const Compare& less = job.less;
+		auto pairIsBelow = [&less](const Pair& pair, const K2& key) {
+			return less(pair.first, key);
+		};
+		unsigned long pairCount = 0;
+		for (Slot& slot : job.slots) {
+			std::vector<Pair>& pairs = slot.mapEmitter.pairs;
+			pairCount += pairs.size();
+			for (int range = 0; range < job.slotCount; ++range) {
+				job.slots[range].rangeRuns.push_back(keyRangeOfRun(pairs.data(), pairs.data() + pairs.size(),
+						samples, range, job.slotCount, pairIsBelow));
+			}
+		}
+		return pairCount;
+	}
+
+	// merges the key range of the slot from the sorted pairs of all slots into
+	// one array of keys and one of values, then reduces it group by group until
+	// the slot should yield
+	template <typename Client>
+	static bool reducePhase(void* arg, int slotId, void* context) {
+		Job<Client>& job = *static_cast<Job<Client>*>(arg);
+		Slot& slot = job.slots[slotId];
+		const Compare& less = job.less;
+		if (!slot.merged) {
+			size_t pairCount = 0;
+			for (const Run& run : slot.rangeRuns) {
+				pairCount += run.second - run.first;
+			}
+			slot.keys.reserve(pairCount);
+			slot.values.reserve(pairCount);
+			RangeCollector collector = {slot};
+			mergeSortedRuns(slot.rangeRuns, [&less](const Pair& a, const Pair& b) {
+				return less(a.first, b.first);
+			}, collector);
+			slot.merged = true;
+		}
+
+		while (slot.nextGroup < slot.groupEnds.size()) {
+			size_t groupBegin = slot.nextGroup == 0 ? 0 : slot.groupEnds[slot.nextGroup - 1];
+			size_t groupEnd = slot.groupEnds[slot.nextGroup++];
+			job.client.reduce(slot.keys[groupBegin], slot.values.data() + groupBegin,
+					slot.values.data() + groupEnd, slot.reduceEmitter);
+			addJobProgress(context, groupEnd - groupBegin);
+			if (jobShouldYield(context)) {
+				return false;
+			}
+		}
+		std::vector<K2>().swap(slot.keys);
+		std::vector<V2>().swap(slot.values);
+		return true;
+	}
+
+	// appends the output of every slot in key range order, by the last slot to finish
+	template <typename Client>
+	static void finishPhase(void* arg) {
+		Job<Client>& job = *static_cast<Job<Client>*>(arg);
+		for (Slot& slot : job.slots) {
+			job.output.insert(job.output.end(),
+					std::make_move_iterator(slot.reduceEmitter.output.begin()),
+					std::make_move_iterator(slot.reduceEmitter.output.end()));
+		}
+	}
+
+	template <typename Client>
+	static void destroyJob(void* arg) {
+		delete static_cast<Job<Client>*>(arg);
+	}
+};
+
+
+#endif //MAPREDUCEJOB_H
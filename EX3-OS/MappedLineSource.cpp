@@ -0,0 +1,156 @@
+#include "MappedLineSource.h"
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Maps every file read-only and asks the kernel for sequential readahead.
+ * @param paths - the files, read in this order.
+ * @param splitBytes - the bytes of a file a map thread claims at once.
+ */
+MappedLineSource::MappedLineSource(const std::vector<std::string> &paths, size_t splitBytes)
+        : splitBytes(std::max(splitBytes, static_cast<size_t>(1))), splitSpace(0), totalBytes(0), nextSplitOffset(0) {
+    for (const std::string &path : paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stdout, "system error: Unable to open input file %s.\n", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) != 0) {
+            fprintf(stdout, "system error: Unable to stat input file %s.\n", path.c_str());
+            exit(EXIT_FAILURE);
+        }
+        MappedFile file = {nullptr, static_cast<size_t>(fileStat.st_size), splitSpace};
+        if (file.size != 0) {
+            void *data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                fprintf(stdout, "system error: Unable to map input file %s.\n", path.c_str());
+                exit(EXIT_FAILURE);
+            }
+            // only a hint, the lines are read correctly without it
+            madvise(data, file.size, MADV_SEQUENTIAL);
+            file.data = static_cast<const char *>(data);
+        }
+        close(fd);
+        files.push_back(file);
+        totalBytes += file.size;
+        splitSpace += (file.size + this->splitBytes - 1) / this->splitBytes * this->splitBytes;
+    }
+}
+
+MappedLineSource::~MappedLineSource() {
+    for (const MappedFile &file : files) {
+        if (file.data != nullptr) {
+            munmap(const_cast<char *>(file.data), file.size);
+        }
+    }
+}
+
+/**
+ * Claims the next split of a file with one fetch_add and points a LineView at every line that starts in it.
+ * Splits that hold no line start (inside a long line) are skipped.
+ * @param split - the empty split to fill.
+ * @param maxPairs - ignored, splits are splitBytes long.
+ * @return false once all splits were claimed.
+ */
+bool MappedLineSource::nextSplit(InputVec &split, size_t maxPairs) {
+    (void) maxPairs;
+    size_t offset;
+    while ((offset = nextSplitOffset.fetch_add(splitBytes, std::memory_order_relaxed)) < splitSpace) {
+        // the file holding the split is the last one starting at or before it
+        auto file = std::upper_bound(files.begin(), files.end(), offset,
+                                     [](size_t splitOffset, const MappedFile &candidate) {
+                                         return splitOffset < candidate.splitOffset;
+                                     }) - 1;
+        const char *data = file->data;
+        size_t begin = offset - file->splitOffset;
+        size_t end = std::min(begin + splitBytes, file->size);
+        size_t readAheadEnd = std::min(end + splitBytes, file->size);
+        if (end < readAheadEnd) {
+            // start reading the next split of the file while this one is mapped
+            size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t pageBegin = end / pageSize * pageSize;
+            madvise(const_cast<char *>(data + pageBegin), readAheadEnd - pageBegin, MADV_WILLNEED);
+        }
+
+        // the line crossing into the split belongs to the split before. Only this split is searched for
+        // the first line start, a split inside a long line finds none and is skipped without scanning on
+        size_t lineStart = begin;
+        if (begin != 0) {
+            const void *lineBreak = memchr(data + begin - 1, '\n', end - begin + 1);
+            if (lineBreak == nullptr) {
+                continue;
+            }
+            lineStart = static_cast<const char *>(lineBreak) - data + 1;
+        }
+
+        // one scan with a cursor that moves past every line break once. The views are collected in a buffer
+        // of the thread, since their count is only known at the end
+        static thread_local std::vector<LineView> lines;
+        lines.clear();
+        size_t position = lineStart;
+        while (position < end) {
+            const void *lineBreak = memchr(data + position, '\n', file->size - position);
+            size_t lineEnd = lineBreak == nullptr ? file->size : static_cast<const char *>(lineBreak) - data;
+            LineView view;
+            view.data = data + position;
+            view.size = lineEnd - position;
+            if (view.size != 0 && view.data[view.size - 1] == '\r') {
+                --view.size;
+            }
+            lines.push_back(view);
+            position = lineEnd + 1;
+        }
+        if (lines.empty()) {
+            continue;
+        }
+
+        // all views of a split share one array, freed by releaseSplit. The view after the last line
+        // points past its line break, so splitProgress can count the bytes of the split
+        auto *views = new LineView[lines.size() + 1];
+        std::copy(lines.begin(), lines.end(), views);
+        for (size_t i = 0; i < lines.size(); ++i) {
+            split.push_back(InputPair(nullptr, &views[i]));
+        }
+        views[lines.size()].data = data + std::min(position, file->size);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Frees the LineViews of a mapped split, the file stays mapped.
+ * @param split - a split filled by nextSplit.
+ */
+void MappedLineSource::releaseSplit(InputVec &split) {
+    if (!split.empty()) {
+        delete[] static_cast<LineView *>(split.front().second);
+    }
+}
+
+/**
+ * @return the bytes of all the files, the unit of the map progress.
+ */
+unsigned long MappedLineSource::sizeHint() const {
+    return totalBytes;
+}
+
+/**
+ * The bytes from the first line of a split to past the line break of its last line. Every byte belongs to
+ * the line it is in, so the splits of the files count every byte once.
+ * @param split - a split filled by nextSplit, not released yet.
+ * @return the bytes of the split.
+ */
+unsigned long MappedLineSource::splitProgress(const InputVec &split) const {
+    if (split.empty()) {
+        return 0;
+    }
+    const auto *views = static_cast<const LineView *>(split.front().second);
+    return views[split.size()].data - views[0].data;
+}
@@ -0,0 +1,51 @@
+#ifndef MAPPEDLINESOURCE_H
+#define MAPPEDLINESOURCE_H
+
+#include "MapReduceClient.h"
+#include <vector> //std::vector
+#include <string> //std::string
+#include <atomic> //std::atomic
+
+// one line of an input file, without its line break. data points into the
+// mapping of the file and stays valid as long as the MappedLineSource.
+class LineView : public V1 {
+public:
+	LineView() : data(nullptr), size(0) {}
+
+	const char* data;
+	size_t size;
+};
+
+// an InputSource over the lines of files, which are mapped into memory and read
+// with sequential readahead. Map threads claim splits of splitBytes bytes of a
+// file without a lock; a split holds the lines that start in it, so no line is
+// cut. Keys are nullptr and values are LineViews, no line is copied.
+// maxPairs of nextSplit is ignored, the size of a split is given in bytes.
+// Progress is counted in bytes: sizeHint is the size of all the files and a
+// split counts the bytes of its lines, line breaks included.
+class MappedLineSource : public InputSource {
+public:
+	explicit MappedLineSource(const std::vector<std::string>& paths, size_t splitBytes = 1 << 20);
+	virtual ~MappedLineSource();
+	virtual bool nextSplit(InputVec& split, size_t maxPairs);
+	virtual void releaseSplit(InputVec& split);
+	virtual unsigned long sizeHint() const;
+	virtual unsigned long splitProgress(const InputVec& split) const;
+
+private:
+	struct MappedFile {
+		const char* data;
+		size_t size;
+		// offset of the file in the split space, where every file starts on a split boundary
+		size_t splitOffset;
+	};
+
+	std::vector<MappedFile> files;
+	size_t splitBytes;
+	size_t splitSpace;
+	size_t totalBytes;
+	std::atomic<size_t> nextSplitOffset;
+};
+
+
+#endif //MAPPEDLINESOURCE_H
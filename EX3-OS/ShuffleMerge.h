@@ -0,0 +1,85 @@
+#ifndef SHUFFLEMERGE_H
+#define SHUFFLEMERGE_H
+
+#include <vector>     //std::vector
+#include <utility>    //std::pair
+#include <algorithm>  //std::min, std::lower_bound, std::make_heap
+
+// the sampling, key range split and k-way merge of the shuffle, shared by the
+// pointer API of MapReduceFramework.cpp and the typed jobs of MapReduceJob.h.
+
+// keys every thread samples from its sorted run to choose the key ranges
+#define SHUFFLE_SAMPLES_PER_RUN 32
+
+// appends up to SHUFFLE_SAMPLES_PER_RUN evenly spaced keys of a sorted run to
+// samples, keyOf(pair) gives the key of a pair.
+template <typename Pair, typename Key, typename KeyOf>
+void sampleSortedRun(const std::vector<Pair>& run, KeyOf keyOf, std::vector<Key>& samples) {
+	size_t sampleCount = std::min(run.size(), static_cast<size_t>(SHUFFLE_SAMPLES_PER_RUN));
+	for (size_t i = 0; i < sampleCount; ++i) {
+		samples.push_back(keyOf(run[(2 * i + 1) * run.size() / (2 * sampleCount)]));
+	}
+}
+
+// the part of the sorted run [begin, end) in key range `range` of rangeCount,
+// given the sorted samples of all runs. Splitter i is the sample at
+// i * samples / rangeCount and range i holds the keys in [splitter i,
+// splitter i + 1), the first and last ranges are open, so equal keys always
+// meet in one range. pairIsBelow(pair, key) tells whether the key of the pair
+// is smaller than key.
+template <typename Iterator, typename Key, typename PairIsBelow>
+std::pair<Iterator, Iterator> keyRangeOfRun(Iterator begin, Iterator end, const std::vector<Key>& sortedSamples,
+		int range, int rangeCount, PairIsBelow pairIsBelow) {
+	size_t sampleCount = sortedSamples.size();
+	Iterator first = (range == 0 || sampleCount == 0) ? begin :
+			std::lower_bound(begin, end, sortedSamples[range * sampleCount / rangeCount], pairIsBelow);
+	Iterator last = (range == rangeCount - 1 || sampleCount == 0) ? end :
+			std::lower_bound(begin, end, sortedSamples[(range + 1) * sampleCount / rangeCount], pairIsBelow);
+	return std::make_pair(first, last);
+}
+
+// merges runs sorted by pairLess, each an iterator range, into groups of
+// equal keys in the order of pairLess. Every group is passed to visitor as the
+// chunks of consecutive pairs it has in the runs, after all its pairs were
+// compared, so the visitor may move the pairs out. The runs are kept in a
+// binary heap by their next pair, so every pair is visited once and every
+// switch of run costs O(log k) comparisons for k runs.
+template <typename Iterator, typename PairLess, typename Visitor>
+void mergeSortedRuns(const std::vector<std::pair<Iterator, Iterator>>& runs, PairLess pairLess, Visitor& visitor) {
+	typedef std::pair<Iterator, Iterator> Run;
+	std::vector<Run> heap;
+	for (const Run& run : runs) {
+		if (run.first != run.second) {
+			heap.push_back(run);
+		}
+	}
+	auto hasLargerHead = [&pairLess](const Run& a, const Run& b) {
+		return pairLess(*b.first, *a.first);
+	};
+	std::make_heap(heap.begin(), heap.end(), hasLargerHead);
+
+	std::vector<Run> chunks;
+	while (!heap.empty()) {
+		Iterator key = heap.front().first;
+		chunks.clear();
+		// every run left on top has the key at its head, since no run has a smaller head
+		while (!heap.empty() && !pairLess(*key, *heap.front().first)) {
+			std::pop_heap(heap.begin(), heap.end(), hasLargerHead);
+			Run& run = heap.back();
+			Iterator chunkBegin = run.first;
+			while (run.first != run.second && !pairLess(*key, *run.first)) {
+				++run.first;
+			}
+			chunks.push_back(Run(chunkBegin, run.first));
+			if (run.first != run.second) {
+				std::push_heap(heap.begin(), heap.end(), hasLargerHead);
+			} else {
+				heap.pop_back();
+			}
+		}
+		visitor(chunks);
+	}
+}
+
+
+#endif //SHUFFLEMERGE_H
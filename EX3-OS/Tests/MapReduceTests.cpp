@@ -0,0 +1,1512 @@
+#include "MapReduceFramework.h"
+#include "MapReduceJob.h"
+#include "MappedLineSource.h"
+#include "FileOutputSink.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <algorithm>
+#include <pthread.h>
+#include <unistd.h>
+
+// distinct words of the test input
+#define WORD_COUNT 5000
+// half of the input words are one of this many hot words
+#define HOT_WORDS 4
+
+static const int THREAD_LEVELS[] = {1, 2, 3, 8};
+
+typedef std::map<int, long> Counts;
+
+class VLine : public V1 {
+public:
+    std::vector<int> words;
+};
+
+/**
+ * A word, allocated with new or in the arena of a job thread (then it must not be deleted). Output
+ * words are also the input of the next stage of a JobGraph.
+ */
+class KWord : public K1, public HashedK2, public K3 {
+public:
+    explicit KWord(int word, bool inArena = false) : word(word), inArena(inArena) {}
+    virtual bool operator<(const K1 &other) const {
+        return word < static_cast<const KWord &>(other).word;
+    }
+    virtual bool operator<(const K2 &other) const {
+        return word < static_cast<const KWord &>(other).word;
+    }
+    virtual bool operator<(const K3 &other) const {
+        return word < static_cast<const KWord &>(other).word;
+    }
+    virtual size_t hash() const {
+        return static_cast<size_t>(word);
+    }
+    int word;
+    bool inArena;
+};
+
+class VCount : public V1, public V2, public V3 {
+public:
+    explicit VCount(long count, bool inArena = false) : count(count), inArena(inArena) {}
+    long count;
+    bool inArena;
+};
+
+/**
+ * Counts the words of VLine inputs. The client can combine, allocate its intermediate pairs in the
+ * arena and merge partial counts, so one client checks all the paths of the framework.
+ */
+class WordCountClient : public MapReduceClient {
+public:
+    WordCountClient(bool combiner, bool arena, bool partials)
+            : combiner(combiner), arena(arena), partials(partials) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        for (int word : static_cast<const VLine *>(value)->words) {
+            emitCount(word, 1, context);
+        }
+    }
+
+    using MapReduceClient::reduce;
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        int word = static_cast<const KWord *>(pairs->front().first)->word;
+        emit3(new KWord(word), new VCount(takeCounts(pairs)), context);
+    }
+
+    bool hasCombiner() const {
+        return combiner;
+    }
+
+    void combine(const IntermediateVec *pairs, void *context) const {
+        int word = static_cast<const KWord *>(pairs->front().first)->word;
+        emitCount(word, takeCounts(pairs), context);
+    }
+
+    bool canMergePartials() const {
+        return partials;
+    }
+
+    void mergePartials(const OutputVec *pairs, void *context) const {
+        int word = static_cast<const KWord *>(pairs->front().first)->word;
+        long count = 0;
+        for (const OutputPair &pair : *pairs) {
+            count += static_cast<const VCount *>(pair.second)->count;
+            delete pair.first;
+            delete pair.second;
+        }
+        emit3(new KWord(word), new VCount(count), context);
+    }
+
+protected:
+    void emitCount(int word, long count, void *context) const {
+        if (arena) {
+            emit2(arenaNew<KWord>(context, word, true), arenaNew<VCount>(context, count, true), context);
+        } else {
+            emit2(new KWord(word), new VCount(count), context);
+        }
+    }
+
+    /**
+     * Sums the counts of a group and frees the pairs that are not in an arena.
+     */
+    static long takeCounts(const IntermediateVec *pairs) {
+        return takeCounts(pairs->data(), pairs->data() + pairs->size());
+    }
+
+    static long takeCounts(const IntermediatePair *begin, const IntermediatePair *end) {
+        long count = 0;
+        for (const IntermediatePair *pairs = begin; pairs != end; ++pairs) {
+            const IntermediatePair &pair = *pairs;
+            const KWord *key = static_cast<const KWord *>(pair.first);
+            const VCount *value = static_cast<const VCount *>(pair.second);
+            count += value->count;
+            if (!key->inArena) {
+                delete key;
+            }
+            if (!value->inArena) {
+                delete value;
+            }
+        }
+        return count;
+    }
+
+private:
+    bool combiner;
+    bool arena;
+    bool partials;
+};
+
+/**
+ * Writes a (word, count) pair as its two numbers, the pairs read back are allocated with new.
+ */
+class CountSerializer : public IntermediateSerializer {
+public:
+    void serialize(const K2 *key, const V2 *value, std::vector<char> &out) const {
+        int word = static_cast<const KWord *>(key)->word;
+        long count = static_cast<const VCount *>(value)->count;
+        const char *wordBytes = reinterpret_cast<const char *>(&word);
+        const char *countBytes = reinterpret_cast<const char *>(&count);
+        out.insert(out.end(), wordBytes, wordBytes + sizeof(word));
+        out.insert(out.end(), countBytes, countBytes + sizeof(count));
+    }
+
+    void deserialize(const char *data, size_t size, K2 **key, V2 **value) const {
+        (void) size;
+        int word;
+        long count;
+        memcpy(&word, data, sizeof(word));
+        memcpy(&count, data + sizeof(word), sizeof(count));
+        *key = new KWord(word);
+        *value = new VCount(count);
+    }
+};
+
+/**
+ * Builds lineCount lines of wordsPerLine words from a fixed seed, half of them hot words, and counts
+ * the words in reference.
+ */
+static void makeLines(int lineCount, int wordsPerLine, std::vector<VLine> &lines, InputVec &inputVec,
+                      Counts &reference) {
+    lines.resize(lineCount);
+    unsigned long state = 12345;
+    for (VLine &line : lines) {
+        for (int i = 0; i < wordsPerLine; ++i) {
+            state = state * 6364136223846793005UL + 1442695040888963407UL;
+            unsigned long random = state >> 33;
+            int word = (random & 1) ? (random >> 1) % HOT_WORDS : (random >> 1) % WORD_COUNT;
+            line.words.push_back(word);
+            ++reference[word];
+        }
+        inputVec.push_back(InputPair(nullptr, &line));
+    }
+}
+
+/**
+ * Prints the result of one run.
+ * @return 0 when the run passed, 1 otherwise.
+ */
+static int reportRun(const char *name, int threads, bool passed, bool tookPath = true) {
+    printf("%-36s %2d threads  %s\n", name, threads,
+           !passed ? "FAILED" : tookPath ? "ok" : "FAILED (path not taken)");
+    return passed && tookPath ? 0 : 1;
+}
+
+/**
+ * Compares the (word, count) output of a job with the reference counts and frees the output.
+ * @return true when every word appears once with its count.
+ */
+static bool sameCounts(OutputVec &outputVec, const Counts &reference) {
+    Counts counts;
+    bool duplicate = false;
+    for (const OutputPair &pair : outputVec) {
+        int word = static_cast<const KWord *>(pair.first)->word;
+        long count = static_cast<const VCount *>(pair.second)->count;
+        if (!counts.insert(Counts::value_type(word, count)).second) {
+            duplicate = true;
+        }
+        delete pair.first;
+        delete pair.second;
+    }
+    outputVec.clear();
+    return !duplicate && counts == reference;
+}
+
+/**
+ * Checks the output of a job like sameCounts and prints the result of the run.
+ * @param tookPath - false when the stats of the job show it did not use the path under test.
+ * @return 0 when every word appears once with its count, 1 otherwise.
+ */
+static int checkCounts(const char *name, int threads, OutputVec &outputVec, const Counts &reference,
+                       bool tookPath = true) {
+    return reportRun(name, threads, sameCounts(outputVec, reference), tookPath);
+}
+
+/**
+ * Runs a word count job with options at every thread level and checks its output.
+ * @param tookPath - when not nullptr, tells from the stats of a job whether it used the path under test.
+ * @return the number of failed runs.
+ */
+static int checkWordCount(const char *name, const WordCountClient &client, const InputVec &inputVec,
+                          const Counts &reference, const JobOptions &options,
+                          bool (*tookPath)(const JobStats &) = nullptr) {
+    int failures = 0;
+    for (int threads : THREAD_LEVELS) {
+        OutputVec outputVec;
+        JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads, options);
+        waitForJob(job);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+        failures += checkCounts(name, threads, outputVec, reference, tookPath == nullptr || tookPath(stats));
+    }
+    return failures;
+}
+
+static int testShuffleModes() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+
+    static const shuffle_mode_t modes[] = {SERIAL_SHUFFLE, PARALLEL_SHUFFLE, HASH_SHUFFLE};
+    static const char *const names[] = {"serial shuffle", "parallel shuffle", "hash shuffle"};
+    int failures = 0;
+    for (int i = 0; i < 3; ++i) {
+        JobOptions options;
+        options.shuffleMode = modes[i];
+        failures += checkWordCount(names[i], client, inputVec, reference, options);
+    }
+    return failures;
+}
+
+static bool combined(const JobStats &stats) {
+    return stats.combinerOutputPairs < stats.combinerInputPairs;
+}
+
+static int testCombiner() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(true, false, false);
+
+    int failures = 0;
+    JobOptions options;
+    failures += checkWordCount("combiner", client, inputVec, reference, options, combined);
+    // combines many times per thread, also the pairs an earlier combine emitted
+    options.combineThreshold = 64;
+    failures += checkWordCount("combiner every 64 pairs", client, inputVec, reference, options, combined);
+    options.shuffleMode = HASH_SHUFFLE;
+    failures += checkWordCount("combiner with hash shuffle", client, inputVec, reference, options, combined);
+    return failures;
+}
+
+static bool spilled(const JobStats &stats) {
+    return stats.spillRuns > 1 && stats.spilledPairs > 0;
+}
+
+static int testSpill() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    CountSerializer serializer;
+
+    int failures = 0;
+    JobOptions options;
+    options.memoryBudget = 8000;
+    options.serializer = &serializer;
+    failures += checkWordCount("spill", WordCountClient(false, false, false), inputVec, reference, options,
+                               spilled);
+    // the arena of a thread is freed after every spill, its pairs are not released one by one
+    failures += checkWordCount("spill with arena", WordCountClient(false, true, false), inputVec, reference,
+                               options, spilled);
+    options.combineThreshold = 1000;
+    failures += checkWordCount("spill with arena and combiner", WordCountClient(true, true, false), inputVec,
+                               reference, options, spilled);
+    options.shuffleMode = SERIAL_SHUFFLE;
+    failures += checkWordCount("spill with serial shuffle", WordCountClient(false, false, false), inputVec,
+                               reference, options, spilled);
+    return failures;
+}
+
+static int testPipelined() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    CountSerializer serializer;
+    WordCountClient client(false, false, false);
+
+    int failures = 0;
+    JobOptions options;
+    options.pipelined = true;
+    failures += checkWordCount("pipelined", client, inputVec, reference, options);
+    // small grains keep the slots mapping until the very end, so they finish close together
+    options.taskGrain = 1;
+    failures += checkWordCount("pipelined with grain 1", client, inputVec, reference, options);
+    options.taskGrain = 0;
+    options.memoryBudget = 8000;
+    options.serializer = &serializer;
+    failures += checkWordCount("pipelined with spill", client, inputVec, reference, options, spilled);
+    failures += checkWordCount("pipelined with spill and combiner", WordCountClient(true, false, false), inputVec,
+                               reference, options, spilled);
+    return failures;
+}
+
+// a job with one thread has no other thread to share a group with and never splits one
+static bool splitHotKeys(const JobStats &stats) {
+    return stats.threads.size() == 1 || (stats.splitGroups >= HOT_WORDS && stats.partialMerges > 0);
+}
+
+static int testHotKeys() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, true);
+
+    int failures = 0;
+    JobOptions options;
+    // every hot word has about 12500 pairs
+    options.splitGroupPairs = 2000;
+    failures += checkWordCount("hot keys", client, inputVec, reference, options, splitHotKeys);
+    options.largestGroupsFirst = true;
+    failures += checkWordCount("hot keys largest first", client, inputVec, reference, options, splitHotKeys);
+    options.shuffleMode = HASH_SHUFFLE;
+    failures += checkWordCount("hot keys with hash shuffle", client, inputVec, reference, options, splitHotKeys);
+    return failures;
+}
+
+typedef MapReduceJob<int, std::vector<int>, int, long, int, long> TypedWordCount;
+
+struct TypedWordCountClient {
+    void map(const int &line, const std::vector<int> &words, TypedWordCount::MapEmitter &emitter) const {
+        (void) line;
+        for (int word : words) {
+            emitter.emit(word, 1);
+        }
+    }
+
+    void reduce(const int &word, const long *begin, const long *end, TypedWordCount::ReduceEmitter &emitter) const {
+        long count = 0;
+        for (const long *value = begin; value != end; ++value) {
+            count += *value;
+        }
+        emitter.emit(word, count);
+    }
+};
+
+/**
+ * Compares the output of a typed word count with the reference counts, the words must be in order.
+ */
+static bool typedCountsMatch(const TypedWordCount::OutputVec &output, const Counts &reference) {
+    Counts counts;
+    for (size_t i = 0; i < output.size(); ++i) {
+        if (i > 0 && output[i - 1].first >= output[i].first) {
+            return false;
+        }
+        counts[output[i].first] = output[i].second;
+    }
+    return counts == reference;
+}
+
+static int testTyped() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    TypedWordCount::InputVec typedInput;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        typedInput.push_back(std::make_pair(static_cast<int>(i), lines[i].words));
+    }
+    TypedWordCountClient client;
+
+    int failures = 0;
+    for (int threads : THREAD_LEVELS) {
+        TypedWordCount::OutputVec output;
+        TypedWordCount::run(client, typedInput, output, threads);
+        failures += reportRun("typed job", threads, typedCountsMatch(output, reference));
+    }
+    for (int threads : THREAD_LEVELS) {
+        TypedWordCount::OutputVec output;
+        JobHandle job = TypedWordCount::start(client, typedInput, output, threads);
+        waitForJob(job);
+        JobState state;
+        getJobState(job, &state);
+        JobStats stats;
+        getJobStats(job, &stats);
+        closeJobHandle(job);
+        bool tookPath = state.stage == REDUCE_STAGE && state.percentage == 100.0f &&
+                        static_cast<int>(stats.threads.size()) == threads;
+        failures += reportRun("typed job handle", threads, typedCountsMatch(output, reference), tookPath);
+    }
+    // a typed job and a pointer job share the worker pool
+    for (int threads : THREAD_LEVELS) {
+        TypedWordCount::OutputVec output;
+        OutputVec outputVec;
+        WordCountClient pointerClient(false, false, false);
+        JobHandle typedJob = TypedWordCount::start(client, typedInput, output, threads);
+        JobHandle pointerJob = startMapReduceJob(pointerClient, inputVec, outputVec, threads);
+        closeJobHandle(typedJob);
+        closeJobHandle(pointerJob);
+        failures += reportRun("typed job beside a pointer job", threads, typedCountsMatch(output, reference));
+        failures += checkCounts("pointer job beside a typed job", threads, outputVec, reference);
+    }
+    return failures;
+}
+
+/**
+ * A stage of a JobGraph that maps every (word, count) pair of its producers to (key(word, count),
+ * value(word, count)) and sums the values of every key.
+ */
+class FoldClient : public WordCountClient {
+public:
+    FoldClient(int (*key)(int, long), long (*value)(int, long))
+            : WordCountClient(false, false, false), key(key), value(value) {}
+
+    void map(const K1 *inputKey, const V1 *inputValue, void *context) const {
+        int word = static_cast<const KWord *>(inputKey)->word;
+        long count = static_cast<const VCount *>(inputValue)->count;
+        emit2(new KWord(key(word, count)), new VCount(value(word, count)), context);
+    }
+
+    static Counts fold(const Counts &counts, int (*key)(int, long), long (*value)(int, long)) {
+        Counts folded;
+        for (const Counts::value_type &count : counts) {
+            folded[key(count.first, count.second)] += value(count.first, count.second);
+        }
+        return folded;
+    }
+
+private:
+    int (*key)(int, long);
+    long (*value)(int, long);
+};
+
+static int countKey(int word, long count) {
+    (void) word;
+    return static_cast<int>(count);
+}
+
+static int lastDigitKey(int word, long count) {
+    (void) count;
+    return word % 10;
+}
+
+static int wordKey(int word, long count) {
+    (void) count;
+    return word;
+}
+
+static long one(int word, long count) {
+    (void) word;
+    (void) count;
+    return 1;
+}
+
+static long countValue(int word, long count) {
+    (void) word;
+    return count;
+}
+
+static void handOffCount(K3 *key, V3 *value, K1 **inputKey, V1 **inputValue) {
+    *inputKey = static_cast<KWord *>(key);
+    *inputValue = static_cast<VCount *>(value);
+}
+
+static void releaseCount(K1 *key, V1 *value) {
+    delete key;
+    delete value;
+}
+
+/**
+ * Runs a graph in which the word count feeds two stages, a histogram of the counts and the totals per
+ * last digit of the words, and a last stage sums the outputs of both by key.
+ */
+static int testJobGraph() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient wordCount(false, false, false);
+    FoldClient histogram(countKey, one);
+    FoldClient digitTotals(lastDigitKey, countValue);
+    FoldClient join(wordKey, countValue);
+
+    Counts histogramReference = FoldClient::fold(reference, countKey, one);
+    Counts digitReference = FoldClient::fold(reference, lastDigitKey, countValue);
+    Counts joinReference = histogramReference;
+    for (const Counts::value_type &total : digitReference) {
+        joinReference[total.first] += total.second;
+    }
+
+    int failures = 0;
+    for (int threads : THREAD_LEVELS) {
+        JobGraph graph;
+        int counted = graph.addStage(wordCount, inputVec, threads);
+        int histogramStage = graph.addStage(histogram, std::vector<int>(1, counted), handOffCount, releaseCount,
+                                            threads);
+        int digitStage = graph.addStage(digitTotals, std::vector<int>(1, counted), handOffCount, releaseCount,
+                                        threads);
+        graph.start();
+        graph.wait();
+        failures += checkCounts("graph histogram stage", threads, graph.getOutput(histogramStage),
+                                histogramReference);
+        failures += checkCounts("graph digit stage", threads, graph.getOutput(digitStage), digitReference);
+    }
+    for (int threads : THREAD_LEVELS) {
+        JobGraph graph;
+        int counted = graph.addStage(wordCount, inputVec, threads);
+        std::vector<int> producers;
+        producers.push_back(graph.addStage(histogram, std::vector<int>(1, counted), handOffCount, releaseCount,
+                                           threads));
+        producers.push_back(graph.addStage(digitTotals, std::vector<int>(1, counted), handOffCount, releaseCount,
+                                           threads));
+        int joinStage = graph.addStage(join, producers, handOffCount, releaseCount, threads);
+        graph.start();
+        graph.wait();
+        JobState state;
+        getJobState(graph.stageJob(joinStage), &state);
+        bool tookPath = state.stage == REDUCE_STAGE && state.percentage == 100.0f;
+        failures += checkCounts("graph join stage", threads, graph.getOutput(joinStage), joinReference, tookPath);
+    }
+    return failures;
+}
+
+/**
+ * Counts the words of a group through the span reduce, reading the pairs in place, and counts how the
+ * framework called it. The vector reduce must never be called.
+ */
+class SpanCountClient : public WordCountClient {
+public:
+    using MapReduceClient::reduce;
+
+    explicit SpanCountClient(bool partials)
+            : WordCountClient(false, false, partials), vectorCalls(0), wholeGroups(0), groupParts(0),
+              copiedGroups(0) {}
+
+    void reduce(const IntermediateVec *pairs, void *context) const {
+        vectorCalls.fetch_add(1);
+        WordCountClient::reduce(pairs, context);
+    }
+
+    void reduce(const IntermediateSpan &pairs, void *context) const {
+        if (pairs.whole == nullptr) {
+            groupParts.fetch_add(1);
+        } else {
+            wholeGroups.fetch_add(1);
+            if (pairs.whole->data() != pairs.begin() || pairs.whole->size() != pairs.size()) {
+                copiedGroups.fetch_add(1);
+            }
+        }
+        int word = static_cast<const KWord *>(pairs[0].first)->word;
+        emit3(new KWord(word), new VCount(takeCounts(pairs.begin(), pairs.end())), context);
+    }
+
+    void resetCalls() {
+        vectorCalls = 0;
+        wholeGroups = 0;
+        groupParts = 0;
+        copiedGroups = 0;
+    }
+
+    mutable std::atomic<unsigned long> vectorCalls;
+    mutable std::atomic<unsigned long> wholeGroups;
+    mutable std::atomic<unsigned long> groupParts;
+    mutable std::atomic<unsigned long> copiedGroups;
+};
+
+static int testSpanReduce() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+
+    int failures = 0;
+    SpanCountClient client(false);
+    for (int threads : THREAD_LEVELS) {
+        client.resetCalls();
+        OutputVec outputVec;
+        closeJobHandle(startMapReduceJob(client, inputVec, outputVec, threads));
+        // every group reaches the span reduce once, as a view of the group vector itself
+        bool tookPath = client.vectorCalls == 0 && client.groupParts == 0 && client.copiedGroups == 0 &&
+                        client.wholeGroups == reference.size();
+        failures += checkCounts("span reduce", threads, outputVec, reference, tookPath);
+    }
+    SpanCountClient splitClient(true);
+    JobOptions options;
+    options.splitGroupPairs = 2000;
+    for (int threads : THREAD_LEVELS) {
+        splitClient.resetCalls();
+        OutputVec outputVec;
+        closeJobHandle(startMapReduceJob(splitClient, inputVec, outputVec, threads, options));
+        // the parts of the split hot words are views into their group, not whole groups
+        bool tookPath = splitClient.vectorCalls == 0 && splitClient.copiedGroups == 0 &&
+                        (threads == 1 || splitClient.groupParts > HOT_WORDS);
+        failures += checkCounts("span reduce of split groups", threads, outputVec, reference, tookPath);
+    }
+    return failures;
+}
+
+static bool mergedSpillRuns(const JobStats &stats) {
+    // the open runs of a thread stay bounded, every merge replaces 8 runs with one
+    return stats.spillMerges > 0 && stats.spillRuns - 7 * stats.spillMerges <= 16 * stats.threads.size();
+}
+
+static int testSpillMerges() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    CountSerializer serializer;
+
+    int failures = 0;
+    JobOptions options;
+    // about 50 runs per thread, more than a thread keeps open
+    options.memoryBudget = 2000;
+    options.serializer = &serializer;
+    failures += checkWordCount("spill past the open run limit", WordCountClient(false, false, false), inputVec,
+                               reference, options, mergedSpillRuns);
+    failures += checkWordCount("spill past the limit with arena", WordCountClient(false, true, false), inputVec,
+                               reference, options, mergedSpillRuns);
+    options.pipelined = true;
+    failures += checkWordCount("spill past the limit pipelined", WordCountClient(false, false, false), inputVec,
+                               reference, options, mergedSpillRuns);
+    return failures;
+}
+
+/**
+ * Shuts the worker pool down, and every other time sizes it again, until told to stop.
+ */
+static void *churnWorkerPool(void *arg) {
+    std::atomic<bool> *stop = static_cast<std::atomic<bool> *>(arg);
+    for (int round = 0; !stop->load(); ++round) {
+        if (round % 2 == 0) {
+            shutdownWorkerPool();
+        } else {
+            initWorkerPool(2);
+        }
+    }
+    return nullptr;
+}
+
+static int testPoolShutdown() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(500, 20, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+
+    std::atomic<bool> stop(false);
+    pthread_t churn;
+    if (pthread_create(&churn, nullptr, churnWorkerPool, &stop) != 0) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+    }
+    // jobs started while the pool shuts down must still finish, on a new pool
+    int failures = 0;
+    for (int threads : THREAD_LEVELS) {
+        bool passed = true;
+        for (int round = 0; round < 20; ++round) {
+            OutputVec outputVec;
+            closeJobHandle(startMapReduceJob(client, inputVec, outputVec, threads));
+            passed = sameCounts(outputVec, reference) && passed;
+        }
+        failures += reportRun("20 jobs during pool shutdowns", threads, passed);
+    }
+    stop = true;
+    pthread_join(churn, nullptr);
+    shutdownWorkerPool();
+    return failures;
+}
+
+/**
+ * Hands out the lines of a test input one by one to a GeneratorInputSource and counts how often every
+ * line was released and how often two threads were inside next at once.
+ */
+struct LineGenerator {
+    explicit LineGenerator(std::vector<VLine> &lines)
+            : lines(lines), next(0), releases(lines.size()), inside(false), overlaps(0) {}
+
+    std::vector<VLine> &lines;
+    size_t next;
+    std::vector<std::atomic<int>> releases;
+    std::atomic<bool> inside;
+    std::atomic<int> overlaps;
+};
+
+static bool generateLine(void *state, K1 **key, V1 **value) {
+    LineGenerator *generator = static_cast<LineGenerator *>(state);
+    if (generator->inside.exchange(true)) {
+        generator->overlaps.fetch_add(1);
+    }
+    bool generated = generator->next < generator->lines.size();
+    if (generated) {
+        *key = nullptr;
+        *value = &generator->lines[generator->next++];
+    }
+    generator->inside = false;
+    return generated;
+}
+
+static void releaseLine(void *state, K1 *key, V1 *value) {
+    (void) key;
+    LineGenerator *generator = static_cast<LineGenerator *>(state);
+    generator->releases[static_cast<VLine *>(value) - generator->lines.data()].fetch_add(1);
+}
+
+/**
+ * An InputSource over the lines of a test input that counts its progress in words, and records the
+ * sizes the framework asks for and the splits it releases.
+ */
+class WordSizedSource : public InputSource {
+public:
+    explicit WordSizedSource(const InputVec &inputVec)
+            : inputVec(inputVec), words(0), next(0), otherRequests(0), expectedRequest(0), releasedPairs(0),
+              progressedWords(0) {
+        for (const InputPair &pair : inputVec) {
+            words += static_cast<const VLine *>(pair.second)->words.size();
+        }
+    }
+
+    void reset(size_t grain) {
+        next = 0;
+        otherRequests = 0;
+        expectedRequest = grain;
+        releasedPairs = 0;
+        progressedWords = 0;
+    }
+
+    bool nextSplit(InputVec &split, size_t maxPairs) {
+        if (maxPairs != expectedRequest) {
+            otherRequests.fetch_add(1);
+        }
+        size_t begin = next.fetch_add(maxPairs);
+        if (begin >= inputVec.size()) {
+            return false;
+        }
+        size_t end = std::min(begin + maxPairs, inputVec.size());
+        split.insert(split.end(), inputVec.begin() + begin, inputVec.begin() + end);
+        return true;
+    }
+
+    void releaseSplit(InputVec &split) {
+        releasedPairs.fetch_add(split.size());
+    }
+
+    unsigned long sizeHint() const {
+        return words;
+    }
+
+    unsigned long splitProgress(const InputVec &split) const {
+        unsigned long splitWords = 0;
+        for (const InputPair &pair : split) {
+            splitWords += static_cast<const VLine *>(pair.second)->words.size();
+        }
+        progressedWords.fetch_add(splitWords);
+        return splitWords;
+    }
+
+    const InputVec &inputVec;
+    unsigned long words;
+    std::atomic<size_t> next;
+    std::atomic<int> otherRequests;
+    size_t expectedRequest;
+    std::atomic<size_t> releasedPairs;
+    mutable std::atomic<unsigned long> progressedWords;
+};
+
+static int testInputSources() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+
+    int failures = 0;
+    for (int threads : THREAD_LEVELS) {
+        LineGenerator generator(lines);
+        GeneratorInputSource source(generateLine, &generator, releaseLine);
+        OutputVec outputVec;
+        closeJobHandle(startMapReduceJob(client, source, outputVec, threads));
+        // next was never entered twice at once, and every line was released exactly once
+        bool tookPath = generator.overlaps == 0 && generator.next == lines.size();
+        for (const std::atomic<int> &releases : generator.releases) {
+            tookPath = tookPath && releases == 1;
+        }
+        failures += checkCounts("generator source", threads, outputVec, reference, tookPath);
+    }
+    WordSizedSource source(inputVec);
+    JobOptions options;
+    options.taskGrain = 7;
+    for (int threads : THREAD_LEVELS) {
+        source.reset(options.taskGrain);
+        OutputVec outputVec;
+        JobHandle job = startMapReduceJob(client, source, outputVec, threads, options);
+        waitForJob(job);
+        JobState state;
+        getJobState(job, &state);
+        closeJobHandle(job);
+        // splits of the task grain, every one released, and the progress counted every word once
+        bool tookPath = source.otherRequests == 0 && source.releasedPairs == inputVec.size() &&
+                        source.progressedWords == source.words && state.stage == REDUCE_STAGE &&
+                        state.percentage == 100.0f;
+        failures += checkCounts("input source of words", threads, outputVec, reference, tookPath);
+    }
+    return failures;
+}
+
+/**
+ * Writes contents to a new temporary file.
+ * @return the path of the file, to remove once done.
+ */
+static std::string writeTempFile(const std::string &contents) {
+    char path[] = "/tmp/MapReduceTestsXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size()) ||
+        close(fd) != 0) {
+        fprintf(stderr, "cannot write a temporary file\n");
+        exit(EXIT_FAILURE);
+    }
+    return path;
+}
+
+/**
+ * Appends the words of lines [begin, end) of the test input as text, every line ended by lineBreak.
+ * @return the bytes of the lines without their line breaks.
+ */
+static size_t appendLines(const std::vector<VLine> &lines, size_t begin, size_t end, const char *lineBreak,
+                          std::string &text) {
+    size_t lineBytes = 0;
+    for (size_t i = begin; i < end; ++i) {
+        size_t lineStart = text.size();
+        for (size_t j = 0; j < lines[i].words.size(); ++j) {
+            text += (j == 0 ? "" : " ") + std::to_string(lines[i].words[j]);
+        }
+        lineBytes += text.size() - lineStart;
+        text += lineBreak;
+    }
+    return lineBytes;
+}
+
+/**
+ * Counts the words of the LineViews of a MappedLineSource, and the lines and bytes it was given.
+ */
+class LineWordCountClient : public WordCountClient {
+public:
+    LineWordCountClient() : WordCountClient(false, false, false), lines(0), lineBytes(0), lineBreaks(0) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        const LineView *line = static_cast<const LineView *>(value);
+        lines.fetch_add(1);
+        lineBytes.fetch_add(line->size);
+        int word = -1;
+        for (size_t i = 0; i < line->size; ++i) {
+            char c = line->data[i];
+            if (c >= '0' && c <= '9') {
+                word = (word < 0 ? 0 : word * 10) + (c - '0');
+                continue;
+            }
+            if (c == '\r' || c == '\n') {
+                lineBreaks.fetch_add(1);
+            }
+            if (word >= 0) {
+                emitCount(word, 1, context);
+            }
+            word = -1;
+        }
+        if (word >= 0) {
+            emitCount(word, 1, context);
+        }
+    }
+
+    void resetLines() {
+        lines = 0;
+        lineBytes = 0;
+        lineBreaks = 0;
+    }
+
+    mutable std::atomic<size_t> lines;
+    mutable std::atomic<size_t> lineBytes;
+    mutable std::atomic<size_t> lineBreaks;
+};
+
+static int testMappedLines() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(320, 50, lines, inputVec, reference);
+
+    // a last line without a line break, an empty file, CRLF lines, and a line longer than many splits
+    std::string first;
+    std::string crlf;
+    std::string longLine;
+    size_t lineBytes = appendLines(lines, 0, 99, "\n", first) + appendLines(lines, 99, 100, "", first);
+    lineBytes += appendLines(lines, 100, 200, "\r\n", crlf);
+    for (size_t i = 200; i < 300; ++i) {
+        lineBytes += appendLines(lines, i, i + 1, i == 299 ? "\n" : " ", longLine);
+    }
+    lineBytes += 99;
+    lineBytes += appendLines(lines, 300, 320, "\n", longLine);
+    std::vector<std::string> paths = {writeTempFile(first), writeTempFile(""), writeTempFile(crlf),
+                                      writeTempFile(longLine)};
+    size_t fileBytes = first.size() + crlf.size() + longLine.size();
+
+    int failures = 0;
+    LineWordCountClient client;
+    static const size_t splitSizes[] = {7, 1 << 20};
+    for (size_t splitBytes : splitSizes) {
+        for (int threads : THREAD_LEVELS) {
+            MappedLineSource source(paths, splitBytes);
+            client.resetLines();
+            OutputVec outputVec;
+            JobHandle job = startMapReduceJob(client, source, outputVec, threads);
+            waitForJob(job);
+            JobState state;
+            getJobState(job, &state);
+            closeJobHandle(job);
+            // every line once, cut at its line break (and CR) only, and the progress counted every byte
+            bool tookPath = client.lines == 221 && client.lineBytes == lineBytes && client.lineBreaks == 0 &&
+                            source.sizeHint() == fileBytes && state.stage == REDUCE_STAGE &&
+                            state.percentage == 100.0f;
+            failures += checkCounts(splitBytes == 7 ? "mapped lines, 7 byte splits" : "mapped lines",
+                                    threads, outputVec, reference, tookPath);
+        }
+    }
+    for (const std::string &path : paths) {
+        remove(path.c_str());
+    }
+    return failures;
+}
+
+/**
+ * Formats an output pair as a "word count" line.
+ */
+static void formatCount(const K3 *key, const V3 *value, std::string &out) {
+    out += std::to_string(static_cast<const KWord *>(key)->word) + " " +
+           std::to_string(static_cast<const VCount *>(value)->count) + "\n";
+}
+
+/**
+ * Reads back a file of "word count" lines written by a FileOutputSink and compares it with the reference.
+ * @return true when every word is on one whole line with its count.
+ */
+static bool fileHasCounts(const std::string &path, const Counts &reference) {
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    Counts counts;
+    bool wellFormed = true;
+    int word;
+    long count;
+    char end;
+    int fields;
+    while ((fields = fscanf(file, "%d %ld%c", &word, &count, &end)) != EOF) {
+        if (fields != 3 || end != '\n' || !counts.insert(Counts::value_type(word, count)).second) {
+            wellFormed = false;
+            break;
+        }
+    }
+    fclose(file);
+    return wellFormed && counts == reference;
+}
+
+static int testFileOutput() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+    std::string path = writeTempFile("left from an earlier run\n");
+
+    int failures = 0;
+    // buffers of a few records each, so threads append to the file many times, and the default buffer
+    static const size_t bufferSizes[] = {64, 1 << 16};
+    for (size_t bufferBytes : bufferSizes) {
+        for (int threads : THREAD_LEVELS) {
+            OutputVec outputVec;
+            {
+                FileOutputSink sink(path, formatCount, true, bufferBytes);
+                JobOptions options;
+                options.outputSink = &sink;
+                closeJobHandle(startMapReduceJob(client, inputVec, outputVec, threads, options));
+            }
+            // the file replaced what was there, every record is whole and the OutputVec stays empty
+            failures += reportRun(bufferBytes == 64 ? "file output, small buffers" : "file output", threads,
+                                  outputVec.empty() && fileHasCounts(path, reference));
+        }
+    }
+    remove(path.c_str());
+    return failures;
+}
+
+// normalizedPrefix calls of all PrefixedWords
+static std::atomic<unsigned long> prefixCalls(0);
+
+/**
+ * A word with a normalized prefix: the word itself, which is exact, or the word shifted right, which
+ * leaves runs of equal prefixes for operator< to sort.
+ */
+class PrefixedWord : public KWord {
+public:
+    PrefixedWord(int word, int prefixShift) : KWord(word), prefixShift(prefixShift) {}
+
+    bool normalizedPrefix(uint64_t *prefix) const {
+        prefixCalls.fetch_add(1, std::memory_order_relaxed);
+        *prefix = static_cast<uint64_t>(word) >> prefixShift;
+        return true;
+    }
+
+    bool prefixIsExact() const {
+        return prefixShift == 0;
+    }
+
+    int prefixShift;
+};
+
+/**
+ * Counts words emitted as PrefixedWords, so the threads radix sort their pairs.
+ */
+class PrefixedCountClient : public WordCountClient {
+public:
+    explicit PrefixedCountClient(int prefixShift) : WordCountClient(false, false, false), prefixShift(prefixShift) {}
+
+    void map(const K1 *key, const V1 *value, void *context) const {
+        (void) key;
+        for (int word : static_cast<const VLine *>(value)->words) {
+            emit2(new PrefixedWord(word, prefixShift), new VCount(1), context);
+        }
+    }
+
+private:
+    int prefixShift;
+};
+
+static int testRadixSort() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+
+    static const shuffle_mode_t modes[] = {SERIAL_SHUFFLE, PARALLEL_SHUFFLE};
+    int failures = 0;
+    for (int prefixShift : {0, 4}) {
+        PrefixedCountClient client(prefixShift);
+        for (shuffle_mode_t mode : modes) {
+            JobOptions options;
+            options.shuffleMode = mode;
+            for (int threads : THREAD_LEVELS) {
+                prefixCalls = 0;
+                OutputVec outputVec;
+                JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads, options);
+                waitForJob(job);
+                JobStats stats;
+                getJobStats(job, &stats);
+                closeJobHandle(job);
+                // a thread with 256 pairs or more radix sorts them, so it reads the prefix of each of its keys.
+                // A wrong order of equal prefixes would split groups
+                unsigned long radixSortedPairs = 0;
+                for (const ThreadStats &thread : stats.threads) {
+                    radixSortedPairs += thread.emittedPairs >= 256 ? thread.emittedPairs : 0;
+                }
+                bool tookPath = radixSortedPairs > 0 && prefixCalls >= radixSortedPairs;
+                failures += checkCounts(prefixShift == 0 ? "radix sort, exact prefixes" : "radix sort, shared prefixes",
+                                        threads, outputVec, reference, tookPath);
+            }
+        }
+    }
+    return failures;
+}
+
+static int testOutputChunks() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+
+    static const shuffle_mode_t modes[] = {PARALLEL_SHUFFLE, HASH_SHUFFLE};
+    static const char *const names[] = {"output chunks", "output chunks of hash shuffle"};
+    int failures = 0;
+    for (int i = 0; i < 2; ++i) {
+        JobOptions options;
+        options.mergeOutput = false;
+        options.shuffleMode = modes[i];
+        for (int threads : THREAD_LEVELS) {
+            OutputVec outputVec;
+            JobHandle job = startMapReduceJob(client, inputVec, outputVec, threads, options);
+            std::vector<OutputVec> chunks;
+            getOutputChunks(job, &chunks);
+            // the chunks were moved out, a second call finds none
+            std::vector<OutputVec> secondChunks;
+            getOutputChunks(job, &secondChunks);
+            closeJobHandle(job);
+            // nothing reached outputVec, and there is one non-empty chunk per thread at most
+            bool tookPath = outputVec.empty() && secondChunks.empty() && !chunks.empty() &&
+                            static_cast<int>(chunks.size()) <= threads;
+            OutputVec allChunks;
+            for (OutputVec &chunk : chunks) {
+                tookPath = tookPath && !chunk.empty();
+                allChunks.insert(allChunks.end(), chunk.begin(), chunk.end());
+            }
+            failures += checkCounts(names[i], threads, allChunks, reference, tookPath);
+        }
+    }
+    return failures;
+}
+
+/**
+ * Checks the totals of the stats of a finished word count against its input and reference counts.
+ * @return true when the totals and the sums of the per-thread stats add up.
+ */
+static bool statsAddUp(const JobStats &stats, int threads, const WordCountClient &client, const Counts &reference,
+                       unsigned long inputWords) {
+    unsigned long threadPairs = 0;
+    unsigned long threadGroups = 0;
+    bool mapped = false;
+    for (const ThreadStats &thread : stats.threads) {
+        threadPairs += thread.emittedPairs;
+        threadGroups += thread.reducedGroups;
+        mapped = mapped || thread.map.wallNanos > 0;
+    }
+    long largestGroup = 0;
+    for (const Counts::value_type &count : reference) {
+        largestGroup = std::max(largestGroup, count.second);
+    }
+    bool totals = static_cast<int>(stats.threads.size()) == threads && mapped && stats.emittedPairs == inputWords &&
+                  threadPairs == stats.emittedPairs && threadGroups == reference.size() &&
+                  stats.shuffledPairs == stats.emittedPairs - stats.combinerInputPairs + stats.combinerOutputPairs;
+    if (client.hasCombiner()) {
+        // every pair went through the combiner, pairs it emitted may go through it again, and it shrank the
+        // groups of the hot words
+        return totals && stats.combinerInputPairs >= inputWords &&
+               stats.combinerOutputPairs < stats.combinerInputPairs &&
+               stats.largestGroupPairs < static_cast<unsigned long>(largestGroup);
+    }
+    return totals && stats.combinerInputPairs == 0 &&
+           stats.largestGroupPairs == static_cast<unsigned long>(largestGroup);
+}
+
+static int testJobStats() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    unsigned long inputWords = 2000 * 50;
+
+    int failures = 0;
+    WordCountClient clients[] = {WordCountClient(false, false, false), WordCountClient(true, false, false),
+                                 WordCountClient(false, true, false)};
+    static const char *const names[] = {"stats totals", "stats totals with combiner", "stats totals with arena"};
+    for (int i = 0; i < 3; ++i) {
+        for (int threads : THREAD_LEVELS) {
+            OutputVec outputVec;
+            JobHandle job = startMapReduceJob(clients[i], inputVec, outputVec, threads);
+            waitForJob(job);
+            JobStats stats;
+            getJobStats(job, &stats);
+            closeJobHandle(job);
+            bool tookPath = statsAddUp(stats, threads, clients[i], reference, inputWords);
+            if (i == 2) {
+                // a key and a value of every pair from the arena, in blocks at least as large
+                tookPath = tookPath && stats.arenaAllocations == 2 * inputWords &&
+                           stats.arenaBytes >= inputWords * (sizeof(KWord) + sizeof(VCount)) &&
+                           stats.arenaBlockBytes >= stats.arenaBytes;
+            } else {
+                tookPath = tookPath && stats.arenaAllocations == 0;
+            }
+            failures += checkCounts(names[i], threads, outputVec, reference, tookPath);
+        }
+    }
+    return failures;
+}
+
+/**
+ * A parsed JSON value, enough of JSON to read back a Chrome trace.
+ */
+struct JsonValue {
+    enum Type {NULL_VALUE, BOOL_VALUE, NUMBER_VALUE, STRING_VALUE, ARRAY_VALUE, OBJECT_VALUE};
+
+    JsonValue() : type(NULL_VALUE), number(0) {}
+
+    // the member with the name, or nullptr
+    const JsonValue *member(const std::string &name) const {
+        for (const std::pair<std::string, JsonValue> &entry : members) {
+            if (entry.first == name) {
+                return &entry.second;
+            }
+        }
+        return nullptr;
+    }
+
+    Type type;
+    double number;
+    std::string text;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+};
+
+/**
+ * A recursive descent JSON parser, strict about the grammar so a malformed trace fails the test.
+ */
+class JsonParser {
+public:
+    explicit JsonParser(const std::string &text) : text(text), position(0) {}
+
+    // parses the whole text as one value, false when it is not valid JSON
+    bool parseDocument(JsonValue &value) {
+        return parseValue(value) && (skipSpace(), position == text.size());
+    }
+
+private:
+    void skipSpace() {
+        while (position < text.size() && strchr(" \t\r\n", text[position]) != nullptr) {
+            ++position;
+        }
+    }
+
+    bool consume(char c) {
+        skipSpace();
+        if (position < text.size() && text[position] == c) {
+            ++position;
+            return true;
+        }
+        return false;
+    }
+
+    bool consumeWord(const char *word) {
+        size_t length = strlen(word);
+        if (text.compare(position, length, word) != 0) {
+            return false;
+        }
+        position += length;
+        return true;
+    }
+
+    bool parseString(std::string &out) {
+        if (!consume('"')) {
+            return false;
+        }
+        while (position < text.size() && text[position] != '"') {
+            char c = text[position++];
+            if (static_cast<unsigned char>(c) < 0x20) {
+                return false;
+            }
+            if (c == '\\') {
+                if (position >= text.size() || strchr("\"\\/bfnrtu", text[position]) == nullptr) {
+                    return false;
+                }
+                c = text[position++];
+            }
+            out += c;
+        }
+        return consume('"');
+    }
+
+    bool parseNumber(double &number) {
+        size_t start = position;
+        if (position < text.size() && text[position] == '-') {
+            ++position;
+        }
+        size_t digits = position;
+        while (position < text.size() && strchr("0123456789.eE+-", text[position]) != nullptr) {
+            ++position;
+        }
+        if (position == digits || !isdigit(static_cast<unsigned char>(text[digits]))) {
+            return false;
+        }
+        char *end;
+        std::string literal = text.substr(start, position - start);
+        number = strtod(literal.c_str(), &end);
+        return *end == '\0';
+    }
+
+    bool parseValue(JsonValue &value) {
+        skipSpace();
+        if (position >= text.size()) {
+            return false;
+        }
+        char c = text[position];
+        if (c == '{') {
+            value.type = JsonValue::OBJECT_VALUE;
+            ++position;
+            if (consume('}')) {
+                return true;
+            }
+            do {
+                std::pair<std::string, JsonValue> entry;
+                if (!parseString(entry.first) || !consume(':') || !parseValue(entry.second)) {
+                    return false;
+                }
+                value.members.push_back(entry);
+            } while (consume(','));
+            return consume('}');
+        }
+        if (c == '[') {
+            value.type = JsonValue::ARRAY_VALUE;
+            ++position;
+            if (consume(']')) {
+                return true;
+            }
+            do {
+                value.items.push_back(JsonValue());
+                if (!parseValue(value.items.back())) {
+                    return false;
+                }
+            } while (consume(','));
+            return consume(']');
+        }
+        if (c == '"') {
+            value.type = JsonValue::STRING_VALUE;
+            return parseString(value.text);
+        }
+        if (c == 't' || c == 'f') {
+            value.type = JsonValue::BOOL_VALUE;
+            return consumeWord(c == 't' ? "true" : "false");
+        }
+        if (c == 'n') {
+            return consumeWord("null");
+        }
+        value.type = JsonValue::NUMBER_VALUE;
+        return parseNumber(value.number);
+    }
+
+    const std::string &text;
+    size_t position;
+};
+
+/**
+ * Reads a trace written by closeJobHandle and checks it is a Chrome trace of the job: valid JSON, one
+ * thread name per job thread, and complete events of those threads with times that are not negative.
+ * @param eventNames - receives the names of the complete events.
+ * @param largestThreadEvents - receives the most complete events of one thread.
+ * @return true when the trace is well formed.
+ */
+static bool readTrace(const std::string &path, int threads, std::set<std::string> &eventNames,
+                      size_t &largestThreadEvents) {
+    std::string text;
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr) {
+        return false;
+    }
+    char buffer[4096];
+    size_t read;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        text.append(buffer, read);
+    }
+    fclose(file);
+
+    JsonValue trace;
+    if (!JsonParser(text).parseDocument(trace) || trace.type != JsonValue::OBJECT_VALUE) {
+        return false;
+    }
+    const JsonValue *events = trace.member("traceEvents");
+    if (events == nullptr || events->type != JsonValue::ARRAY_VALUE) {
+        return false;
+    }
+    std::vector<size_t> threadEvents(threads, 0);
+    int threadNames = 0;
+    for (const JsonValue &event : events->items) {
+        const JsonValue *name = event.member("name");
+        const JsonValue *phase = event.member("ph");
+        const JsonValue *tid = event.member("tid");
+        if (name == nullptr || name->type != JsonValue::STRING_VALUE || phase == nullptr || tid == nullptr ||
+            tid->type != JsonValue::NUMBER_VALUE || tid->number < 0 || tid->number >= threads) {
+            return false;
+        }
+        if (phase->text == "M") {
+            threadNames += name->text == "thread_name" ? 1 : 0;
+            continue;
+        }
+        const JsonValue *start = event.member("ts");
+        const JsonValue *duration = event.member("dur");
+        if (phase->text != "X" || start == nullptr || start->type != JsonValue::NUMBER_VALUE || start->number < 0 ||
+            duration == nullptr || duration->type != JsonValue::NUMBER_VALUE || duration->number < 0) {
+            return false;
+        }
+        eventNames.insert(name->text);
+        ++threadEvents[static_cast<int>(tid->number)];
+    }
+    largestThreadEvents = *std::max_element(threadEvents.begin(), threadEvents.end());
+    return threadNames == threads;
+}
+
+static int testTrace() {
+    std::vector<VLine> lines;
+    InputVec inputVec;
+    Counts reference;
+    makeLines(2000, 50, lines, inputVec, reference);
+    WordCountClient client(false, false, false);
+    std::string path = writeTempFile("");
+
+    int failures = 0;
+    // a ring large enough for every event, and one of 8 events that keeps the latest
+    static const unsigned long ringSizes[] = {16384, 8};
+    for (unsigned long traceEvents : ringSizes) {
+        for (int threads : THREAD_LEVELS) {
+            JobOptions options;
+            options.tracePath = path.c_str();
+            options.traceEvents = traceEvents;
+            OutputVec outputVec;
+            closeJobHandle(startMapReduceJob(client, inputVec, outputVec, threads, options));
+            std::set<std::string> eventNames;
+            size_t largestThreadEvents = 0;
+            bool tookPath = readTrace(path, threads, eventNames, largestThreadEvents) &&
+                            largestThreadEvents <= traceEvents;
+            if (traceEvents == 8) {
+                // the latest events of a thread are of the end of the job
+                tookPath = tookPath && largestThreadEvents == 8 && eventNames.count("reduce task") == 1;
+            } else {
+                tookPath = tookPath && eventNames.count("map task") == 1 && eventNames.count("sort") == 1 &&
+                           eventNames.count("reduce task") == 1;
+            }
+            failures += checkCounts(traceEvents == 8 ? "trace of the latest events" : "trace", threads, outputVec,
+                                    reference, tookPath);
+        }
+    }
+    remove(path.c_str());
+    return failures;
+}
+
+struct Test {
+    const char *name;
+    int (*run)();
+};
+
+static const Test TESTS[] = {
+        {"shuffle", testShuffleModes},
+        {"combiner", testCombiner},
+        {"spill", testSpill},
+        {"pipelined", testPipelined},
+        {"hotkeys", testHotKeys},
+        {"typed", testTyped},
+        {"graph", testJobGraph},
+        {"span", testSpanReduce},
+        {"spillmerge", testSpillMerges},
+        {"pool", testPoolShutdown},
+        {"source", testInputSources},
+        {"lines", testMappedLines},
+        {"file", testFileOutput},
+        {"radix", testRadixSort},
+        {"chunks", testOutputChunks},
+        {"stats", testJobStats},
+        {"trace", testTrace},
+};
+
+int main(int argc, char **argv) {
+    int failures = 0;
+    bool found = argc < 2;
+    for (const Test &test : TESTS) {
+        if (argc < 2 || strcmp(argv[1], test.name) == 0) {
+            failures += test.run();
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "usage: %s [test], where test is one of:", argv[0]);
+        for (const Test &test : TESTS) {
+            fprintf(stderr, " %s", test.name);
+        }
+        fprintf(stderr, "\n");
+        return EXIT_FAILURE;
+    }
+    if (failures != 0) {
+        printf("%d runs FAILED\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all runs passed\n");
+    return EXIT_SUCCESS;
+}